@@ -0,0 +1,342 @@
+#include "../utils/MemoryProfile.hxx"
+#include "../utils/ProfileFormat.hxx"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace Profiling;
+
+/**
+ * lamp-merge: sums several LAMP memory profiles, text or binary, into one.
+ * A snapshot log counts as the profile of its last complete snapshot, so a
+ * single log can be given to recover the profile of a run that was killed.
+ *
+ *   lamp-merge [-j threads] [-o output] [-b | -z] profile...
+ *
+ * The merge is a map-reduce over load ids.  Mapper threads parse the
+ * inputs and split their records into contiguous load ranges, then one
+ * reducer per range sums the records of all inputs in a MemoryProfiler.
+ * The ranges are written in order, so the output is sorted like the one
+ * written by the runtime.  Only the memory profile sections are merged.
+ */
+
+// distances are already tracked by the runtime, never clamp them again
+static const int MERGE_TRACKED_DISTANCE = 0x7fffffff;
+
+typedef MemoryProfiler<MERGE_TRACKED_DISTANCE> MergeProfiler;
+
+typedef KeyDistanceProfiler<MemoryProfile, MERGE_TRACKED_DISTANCE> MergeTable;
+
+class ProfileInput {
+public:
+    const char *filename;
+
+    bool ok;
+
+    // from the binary or snapshot header, or 1 + the largest id of a text profile
+    uint32_t num_instrs;
+
+    bool has_num_instrs;
+
+    vector<profile_record_t> records;
+
+    // records split by load range, for the reducers
+    vector<vector<profile_record_t> > ranges;
+
+    ProfileInput(const char *filename)
+	: filename(filename), ok(false), num_instrs(0), has_num_instrs(false), records(), ranges() {}
+};
+
+static vector<ProfileInput> inputs;
+
+static vector<MergeProfiler *> reducers;
+
+static uint32_t num_mappers;
+
+static uint32_t num_ranges;
+
+static uint32_t max_load;
+
+static uint32_t num_instrs;
+
+class RecordAppender {
+private:
+    vector<profile_record_t> &records;
+
+public:
+    RecordAppender(vector<profile_record_t> &records) : records(records) {}
+
+    void operator()(const profile_record_t &record) {
+	records.push_back(record);
+    }
+};
+
+static bool read_binary_profile(ProfileInput &input) {
+    BinaryProfileReader reader;
+    if (!reader.open(input.filename)) {
+	fprintf(stderr, "%s: not a valid binary profile\n", input.filename);
+	return false;
+    }
+
+    input.records.reserve(reader.numRecords());
+    RecordAppender appender(input.records);
+    reader.forEachRecord(appender);
+    input.num_instrs = reader.numInstructions();
+    input.has_num_instrs = true;
+    return true;
+}
+
+static bool read_snapshot_log(ProfileInput &input) {
+    SnapshotReader reader;
+    if (!reader.open(input.filename)) {
+	fprintf(stderr, "%s: not a valid snapshot log\n", input.filename);
+	return false;
+    }
+
+    if (reader.validLength() < reader.fileLength()) {
+	fprintf(stderr, "%s: ignoring %lu bytes after the last complete snapshot\n", input.filename,
+		(unsigned long) (reader.fileLength() - reader.validLength()));
+    }
+    if (!reader.isComplete()) {
+	fprintf(stderr, "%s: run did not finish, using its last snapshots\n", input.filename);
+    }
+
+    RecordAppender appender(input.records);
+    reader.forEachRecord(appender);
+    input.num_instrs = reader.numInstructions();
+    input.has_num_instrs = true;
+    return true;
+}
+
+static bool read_text_profile(ProfileInput &input) {
+    FILE *fp = fopen(input.filename, "r");
+    if (fp == NULL) {
+	fprintf(stderr, "%s: unable to open\n", input.filename);
+	return false;
+    }
+
+    char line[256];
+    bool in_profile = false, ended = false;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (strncmp(line, "BEGIN Memory Profile", 20) == 0) {
+	    in_profile = true;
+	    continue;
+	}
+	if (strncmp(line, "END Memory Profile", 18) == 0) {
+	    ended = true;
+	    break;
+	}
+	if (!in_profile)
+	    continue;
+
+	unsigned int load, dist, loop, store;
+	unsigned long long total_count, loop_count;
+	if (sscanf(line, "(%u %u %u %u (%llu %llu ) )", &load, &dist, &loop, &store, &total_count, &loop_count) != 6) {
+	    fprintf(stderr, "%s: malformed line: %s", input.filename, line);
+	    fclose(fp);
+	    return false;
+	}
+
+	profile_record_t record;
+	record.load = load;
+	record.store = store;
+	record.loop = loop;
+	record.dist = dist;
+	record.total_count = total_count;
+	record.loop_count = loop_count;
+	input.records.push_back(record);
+
+	input.num_instrs = max(input.num_instrs, max(load, store) + 1);
+    }
+    fclose(fp);
+
+    if (!ended) {
+	fprintf(stderr, "%s: no complete memory profile\n", input.filename);
+	return false;
+    }
+    return true;
+}
+
+/**
+ * Runs task(worker) on num_workers threads and waits for all of them.
+ */
+static void run_workers(void *(*task)(void *), const uint32_t num_workers) {
+    vector<pthread_t> threads(num_workers);
+    for (uintptr_t worker = 0; worker < num_workers; worker++) {
+	if (pthread_create(&threads[worker], NULL, task, (void *) worker) != 0) {
+	    fprintf(stderr, "Unable to start worker thread\n");
+	    abort();
+	}
+    }
+    for (uint32_t worker = 0; worker < num_workers; worker++) {
+	pthread_join(threads[worker], NULL);
+    }
+}
+
+static void *map_task(void *arg) {
+    const uintptr_t worker = (uintptr_t) arg;
+    for (uint32_t i = worker; i < inputs.size(); i += num_mappers) {
+	ProfileInput &input = inputs[i];
+	if (BinaryProfileReader::isBinaryProfile(input.filename)) {
+	    input.ok = read_binary_profile(input);
+	} else if (SnapshotReader::isSnapshotLog(input.filename)) {
+	    input.ok = read_snapshot_log(input);
+	} else {
+	    input.ok = read_text_profile(input);
+	}
+    }
+    return NULL;
+}
+
+static uint32_t load_range(const uint32_t load) {
+    return (uint32_t) (((uint64_t) load * num_ranges) / ((uint64_t) max_load + 1));
+}
+
+static void *shuffle_task(void *arg) {
+    const uintptr_t worker = (uintptr_t) arg;
+    for (uint32_t i = worker; i < inputs.size(); i += num_mappers) {
+	ProfileInput &input = inputs[i];
+	input.ranges.resize(num_ranges);
+	for (uint64_t r = 0; r < input.records.size(); r++) {
+	    input.ranges[load_range(input.records[r].load)].push_back(input.records[r]);
+	}
+	vector<profile_record_t>().swap(input.records);
+    }
+    return NULL;
+}
+
+static void *reduce_task(void *arg) {
+    const uintptr_t range = (uintptr_t) arg;
+    MergeProfiler *profiler = new MergeProfiler(num_instrs);
+    for (uint32_t i = 0; i < inputs.size(); i++) {
+	const vector<profile_record_t> &records = inputs[i].ranges[range];
+	for (uint64_t r = 0; r < records.size(); r++) {
+	    const profile_record_t &record = records[r];
+	    const Dependence dep(record.store, record.loop, record.dist, record.load);
+	    profiler->getProfile(dep).merge(MemoryProfile(record.total_count, record.loop_count));
+	}
+    }
+    reducers[range] = profiler;
+    return NULL;
+}
+
+class BinaryRecordWriter {
+private:
+    BinaryProfileWriter &writer;
+
+public:
+    BinaryRecordWriter(BinaryProfileWriter &writer) : writer(writer) {}
+
+    void operator()(uint32_t load, uint32_t dist, uint32_t loop, uint32_t store, const MemoryProfile &profile) {
+	profile_record_t record;
+	record.load = load;
+	record.store = store;
+	record.loop = loop;
+	record.dist = dist;
+	record.total_count = profile.getTotalCount();
+	record.loop_count = profile.getLoopCount();
+	writer.add(record);
+    }
+};
+
+static bool write_text_profile(const char *filename) {
+    ofstream out(filename);
+    out<<"BEGIN Memory Profile"<<endl;
+    for (uint32_t r = 0; r < reducers.size(); r++) {
+	out<<*((MergeTable *) reducers[r]);
+    }
+    out<<"END Memory Profile"<<endl;
+    out.close();
+    return !out.fail();
+}
+
+static bool write_binary_profile(const char *filename, const bool compressed) {
+    BinaryProfileWriter writer(num_instrs, compressed);
+    BinaryRecordWriter collector(writer);
+    for (uint32_t r = 0; r < reducers.size(); r++) {
+	reducers[r]->forEach(collector);
+    }
+    return writer.write(filename);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-j threads] [-o output] [-b | -z] profile...\n", program);
+    fprintf(stderr, "  -j  worker threads (default: online processors)\n");
+    fprintf(stderr, "  -o  output file (default: result.lamp.profile)\n");
+    fprintf(stderr, "  -b  write a binary profile, -z a compressed one\n");
+}
+
+int main(int argc, char **argv) {
+    const char *output = "result.lamp.profile";
+    bool binary = false, compressed = false;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:o:bzh")) != -1) {
+	switch (opt) {
+	case 'j': workers = atol(optarg); break;
+	case 'o': output = optarg; break;
+	case 'b': binary = true; break;
+	case 'z': binary = true; compressed = true; break;
+	default: usage(argv[0]); return 1;
+	}
+    }
+
+    if ((optind >= argc) || (workers <= 0)) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+	inputs.push_back(ProfileInput(argv[i]));
+    }
+    num_mappers = min((long) inputs.size(), workers);
+    run_workers(map_task, num_mappers);
+
+    uint32_t header_instrs = 0;
+    bool mismatched = false;
+    num_instrs = 0;
+    max_load = 0;
+    for (uint32_t i = 0; i < inputs.size(); i++) {
+	const ProfileInput &input = inputs[i];
+	if (!input.ok)
+	    return 1;
+
+	if (input.has_num_instrs) {
+	    mismatched = mismatched || ((header_instrs != 0) && (header_instrs != input.num_instrs));
+	    header_instrs = max(header_instrs, input.num_instrs);
+	}
+	num_instrs = max(num_instrs, input.num_instrs);
+	for (uint64_t r = 0; r < input.records.size(); r++) {
+	    max_load = max(max_load, input.records[r].load);
+	}
+    }
+
+    // ids are global to the instrumented program, so a smaller profile just
+    // never saw the higher ones
+    if (mismatched) {
+	fprintf(stderr, "warning: profiles have different instruction counts, using %u\n", num_instrs);
+    }
+
+    // one reducer per load range
+    num_ranges = min((long) max_load + 1, workers);
+    run_workers(shuffle_task, num_mappers);
+
+    reducers.assign(num_ranges, NULL);
+    run_workers(reduce_task, num_ranges);
+
+    const bool written = binary ? write_binary_profile(output, compressed) : write_text_profile(output);
+    if (!written) {
+	fprintf(stderr, "Unable to write %s\n", output);
+	return 1;
+    }
+    return 0;
+}
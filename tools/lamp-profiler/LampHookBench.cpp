@@ -0,0 +1,594 @@
+#include "lamp_inline.h"
+#include "../utils/MemoryMap.hxx"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include <map>
+#include <string>
+
+using namespace std;
+using namespace Memory;
+
+/**
+ * Microbenchmark of the LAMP hooks on synthetic access patterns, and of
+ * the MemoryWordMap lookups behind them.  Each pattern runs in a forked
+ * child with a fresh runtime, so the runtime's LAMP_PROFILE_* variables
+ * apply, and reports the time per hook call and the shadow memory held
+ * per byte of application memory touched.
+ *
+ *   make LampHookBench && ./LampHookBench [-s] [-o file] [-c file [-t percent]] [pattern...]
+ *
+ * -o saves the times as a baseline; -c exits 1 if a pattern is slower
+ * than the baseline by more than the tolerance (default 10%).  -s times
+ * the hooks specialized by LAMP_init against the generic ones for every
+ * combination of the silent store, iteration and output flags.
+ */
+
+static const uint64_t SPAN = (8ULL << 20);
+
+static const uint32_t LAMP_INSTRS = 64;
+
+static const uint32_t LAMP_LOOPS = 256;
+
+typedef struct result_s {
+    uint64_t hooks;
+    uint64_t app_bytes;
+    uint64_t shadow_bytes;
+    double seconds;
+} result_t;
+
+typedef struct pattern_s {
+    const char *name;
+    void (*run)(result_t &result);
+} pattern_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint8_t *new_buffer(const uint64_t bytes) {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, 4096, bytes) != 0) {
+	fprintf(stderr, "Unable to allocate %lu bytes\n", (unsigned long) bytes);
+	abort();
+    }
+    memset(buffer, 0, bytes);
+    return (uint8_t *) buffer;
+}
+
+static uint64_t addr(const void *p) {
+    return (uint64_t) (intptr_t) p;
+}
+
+/**
+ * Store then load streams over every word of the span.
+ */
+static void sequential(result_t &result) {
+    static const uint32_t PASSES = 4;
+    uint64_t *a = (uint64_t *) new_buffer(SPAN);
+    const uint64_t n = SPAN / sizeof(uint64_t);
+
+    const double start = now();
+    LAMP_loop_invocation(1);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_store8(1, addr(&a[i]), i);
+	}
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_load8(2, addr(&a[i]));
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (2 * n + 1) + 2;
+    result.app_bytes = SPAN;
+}
+
+/**
+ * sequential through the inline hooks of lamp_inline.h.
+ */
+static void sequential_inline(result_t &result) {
+    static const uint32_t PASSES = 4;
+    uint64_t *a = (uint64_t *) new_buffer(SPAN);
+    const uint64_t n = SPAN / sizeof(uint64_t);
+
+    const double start = now();
+    LAMP_loop_invocation(1);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_inline_store8(1, addr(&a[i]), i);
+	}
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_inline_load8(2, addr(&a[i]));
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (2 * n + 1) + 2;
+    result.app_bytes = SPAN;
+}
+
+/**
+ * One word per 4 KB page and cache line, so every access changes page.
+ */
+static void strided(result_t &result) {
+    static const uint32_t PASSES = 256;
+    static const uint64_t STRIDE = 4096 + 64;
+    uint8_t *a = new_buffer(SPAN);
+    const uint64_t n = SPAN / STRIDE;
+
+    const double start = now();
+    LAMP_loop_invocation(2);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_store8(3, addr(a + i * STRIDE), i);
+	    LAMP_load8(4, addr(a + i * STRIDE));
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (2 * n + 1) + 2;
+    result.app_bytes = n * sizeof(uint64_t);
+}
+
+/**
+ * c[i] = a[i] + b[i] with both loads through one instruction, as in an
+ * inlined helper, so the instruction alternates between two pages.
+ */
+static void gather(result_t &result) {
+    static const uint32_t PASSES = 4;
+    const uint64_t n = SPAN / 3 / sizeof(uint64_t);
+    uint64_t *a = (uint64_t *) new_buffer(n * sizeof(uint64_t));
+    uint64_t *b = (uint64_t *) new_buffer(n * sizeof(uint64_t));
+    uint64_t *c = (uint64_t *) new_buffer(n * sizeof(uint64_t));
+
+    const double start = now();
+    LAMP_loop_invocation(6);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_load8(13, addr(&a[i]));
+	    LAMP_load8(13, addr(&b[i]));
+	    LAMP_store8(14, addr(&c[i]), i);
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (3 * n + 1) + 2;
+    result.app_bytes = 3 * n * sizeof(uint64_t);
+}
+
+/**
+ * Chases a random cycle through the span, storing every fourth hop.
+ */
+static void random_chase(result_t &result) {
+    static const uint32_t PASSES = 2;
+    const uint64_t n = SPAN / sizeof(uint64_t);
+    uint64_t *next = (uint64_t *) new_buffer(SPAN);
+
+    // Sattolo's shuffle gives a single cycle through every slot
+    for (uint64_t i = 0; i < n; i++) {
+	next[i] = i;
+    }
+    uint64_t seed = 12345;
+    for (uint64_t i = n - 1; i > 0; i--) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	const uint64_t j = (seed >> 33) % i;
+	const uint64_t t = next[i];
+	next[i] = next[j];
+	next[j] = t;
+    }
+
+    const double start = now();
+    uint64_t hooks = 0, index = 0;
+    LAMP_loop_invocation(3);
+    for (uint64_t hop = 0; hop < PASSES * n; hop++) {
+	LAMP_loop_iteration_begin();
+	LAMP_load8(5, addr(&next[index]));
+	hooks += 2;
+	if ((hop & 3) == 0) {
+	    LAMP_store8(6, addr(&next[index]), next[index]);
+	    hooks++;
+	}
+	index = next[index];
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = hooks + 2;
+    result.app_bytes = SPAN;
+}
+
+/**
+ * A short inner loop under 64 enclosing loops, entered over and over.
+ */
+static void loop_nest(result_t &result) {
+    static const uint32_t REPEATS = 20000;
+    static const uint32_t DEPTH = 64;
+    static const uint32_t INNER = 16;
+    uint64_t *a = (uint64_t *) new_buffer(INNER * sizeof(uint64_t));
+
+    const double start = now();
+    for (uint32_t r = 0; r < REPEATS; r++) {
+	for (uint32_t d = 0; d < DEPTH; d++) {
+	    LAMP_loop_invocation(10 + d);
+	    LAMP_loop_iteration_begin();
+	}
+	LAMP_loop_invocation(10 + DEPTH);
+	for (uint32_t i = 0; i < INNER; i++) {
+	    LAMP_loop_iteration_begin();
+	    LAMP_load8(7, addr(&a[i]));
+	    LAMP_store8(8, addr(&a[i]), r);
+	}
+	LAMP_loop_exit();
+	for (uint32_t d = 0; d < DEPTH; d++) {
+	    LAMP_loop_exit();
+	}
+    }
+    result.seconds = now() - start;
+
+    result.hooks = REPEATS * (3 * DEPTH + 2 + 3 * INNER);
+    result.app_bytes = INNER * sizeof(uint64_t);
+}
+
+/**
+ * Every access straddles the natural alignment of its size.
+ */
+static void unaligned(result_t &result) {
+    static const uint32_t PASSES = 8;
+    static const uint64_t BYTES = (1ULL << 20);
+    uint8_t *a = new_buffer(BYTES + 16);
+    const uint64_t n = BYTES / sizeof(uint64_t);
+
+    const double start = now();
+    LAMP_loop_invocation(4);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_store8(9, addr(a + i * 8 + 3), i);
+	    LAMP_load4(10, addr(a + i * 8 + 1));
+	    LAMP_load2(11, addr(a + i * 8 + 7));
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (3 * n + 1) + 2;
+    result.app_bytes = BYTES + 8;
+}
+
+/**
+ * Word loads over words written by narrower stores: two 4-byte halves,
+ * and in every fourth word a byte store on top of the high half.
+ */
+static void mixed(result_t &result) {
+    static const uint32_t PASSES = 4;
+    uint8_t *a = new_buffer(SPAN);
+    const uint64_t n = SPAN / sizeof(uint64_t);
+
+    const double start = now();
+    LAMP_loop_invocation(7);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_store4(15, addr(a + i * 8), i);
+	    LAMP_store4(16, addr(a + i * 8 + 4), i);
+	    if ((i % 4) == 0) {
+		LAMP_store1(17, addr(a + i * 8 + 5), i);
+	    }
+	}
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_load8(18, addr(a + i * 8));
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (3 * n + n / 4 + 1) + 2;
+    result.app_bytes = SPAN;
+}
+
+/**
+ * memcpy-like traffic of external calls in 256 byte blocks.
+ */
+static void external(result_t &result) {
+    static const uint32_t PASSES = 4;
+    static const uint64_t BLOCK = 256;
+    uint8_t *a = new_buffer(SPAN);
+    const uint64_t n = SPAN / BLOCK;
+
+    const double start = now();
+    LAMP_register(12);
+    LAMP_loop_invocation(5);
+    for (uint32_t pass = 0; pass < PASSES; pass++) {
+	LAMP_loop_iteration_begin();
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_external_store(a + i * BLOCK, BLOCK);
+	}
+	for (uint64_t i = 0; i < n; i++) {
+	    LAMP_external_load(a + i * BLOCK, BLOCK);
+	}
+    }
+    LAMP_loop_exit();
+    result.seconds = now() - start;
+
+    result.hooks = PASSES * (2 * n + 1) + 3;
+    result.app_bytes = SPAN;
+}
+
+/**
+ * Stores and loads at random words of 2048 pages straight on a
+ * MemoryWordMap, without the page cache of the hooks.
+ */
+static void map_lookup(result_t &result, const lookup_t lookup) {
+    static const uint64_t PAGES = 2048;
+    static const uint64_t OPERATIONS = 4000000;
+    typedef MemoryWordMap<uint64_t> WordMap;
+    WordMap map;
+    map.setLookup(lookup);
+
+    const uint64_t base = 0x100000000ULL;
+    const double start = now();
+    uint64_t seed = 12345, sum = 0;
+    for (uint64_t i = 0; i < OPERATIONS; i++) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	const void *p = (const void *) (intptr_t) (base + ((seed >> 33) % (PAGES * 512)) * 8);
+	if (i & 1) {
+	    const uint64_t *value = map.getItem(p);
+	    sum += (value != NULL) ? *value : 0;
+	} else {
+	    map.setItem(p, i);
+	}
+    }
+    result.seconds = now() - start;
+
+    result.hooks = OPERATIONS + (sum & 0);
+    result.app_bytes = PAGES * 4096;
+    result.shadow_bytes = map.numPages() * sizeof(WordMap::PageType);
+}
+
+static void map_hashed(result_t &result) {
+    map_lookup(result, HASHED);
+}
+
+static void map_direct(result_t &result) {
+    map_lookup(result, DIRECT);
+}
+
+static const pattern_t patterns[] = {
+    {"sequential", sequential},
+    {"seq-inline", sequential_inline},
+    {"strided", strided},
+    {"gather", gather},
+    {"random", random_chase},
+    {"loop-nest", loop_nest},
+    {"unaligned", unaligned},
+    {"mixed", mixed},
+    {"external", external},
+    {"map-hashed", map_hashed},
+    {"map-direct", map_direct}
+};
+
+static const uint32_t NUM_PATTERNS = sizeof(patterns) / sizeof(patterns[0]);
+
+/**
+ * Removes the files the runtime left in the child's directory.
+ */
+static void remove_directory(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+	    if (entry->d_name[0] != '.') {
+		const string file = string(path) + "/" + entry->d_name;
+		unlink(file.c_str());
+	    }
+	}
+	closedir(dir);
+    }
+    rmdir(path);
+}
+
+/**
+ * Runs pattern in a child with its own runtime, which the child leaves
+ * with _exit so LAMP_finish does not write a profile.
+ */
+static bool run_pattern(const pattern_t &pattern, const uint32_t flags, const bool generic, result_t &result) {
+    int fds[2];
+    if (pipe(fds) != 0)
+	return false;
+
+    const pid_t pid = fork();
+    if (pid < 0)
+	return false;
+
+    if (pid == 0) {
+	close(fds[0]);
+	char dir[] = "/tmp/lamp-bench.XXXXXX";
+	if ((mkdtemp(dir) == NULL) || (chdir(dir) != 0))
+	    _exit(1);
+
+	if (generic) {
+	    setenv("LAMP_PROFILE_GENERIC_HOOKS", "1", 1);
+	}
+
+	result_t child;
+	memset(&child, 0, sizeof(child));
+	LAMP_init(LAMP_INSTRS, LAMP_LOOPS, 8, flags);
+	pattern.run(child);
+	if (child.shadow_bytes == 0) {
+	    child.shadow_bytes = LAMP_shadow_bytes();
+	}
+
+	remove_directory(dir);
+	const bool written = (write(fds[1], &child, sizeof(child)) == sizeof(child));
+	_exit(written ? 0 : 1);
+    }
+
+    close(fds[1]);
+    const bool read_ok = (read(fds[0], &result, sizeof(result)) == sizeof(result));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return read_ok && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+static double ns_per_hook(const result_t &result) {
+    return result.seconds * 1e9 / result.hooks;
+}
+
+static bool is_selected(const pattern_t &pattern, const int first, const int argc, char **argv) {
+    bool selected = (first == argc);
+    for (int a = first; a < argc; a++) {
+	selected = selected || (strcmp(argv[a], pattern.name) == 0);
+    }
+    return selected;
+}
+
+/**
+ * Generic against specialized hooks, for each LAMP_init combination of
+ * silent stores (0x1), iterations (0x2) and output (0x4).
+ */
+static int compare_hooks(const int first, const int argc, char **argv) {
+    static const char *const FLAG_NAMES[8] = {
+	"flow", "silent", "iter", "silent+iter", "output", "silent+output", "iter+output", "silent+iter+output"
+    };
+
+    printf("%-12s %-20s %10s %10s %8s\n", "pattern", "flags", "generic", "special", "gain");
+    for (uint32_t i = 0; i < NUM_PATTERNS; i++) {
+	const pattern_t &pattern = patterns[i];
+	if (!is_selected(pattern, first, argc, argv))
+	    continue;
+
+	for (uint32_t flags = 0; flags < 8; flags++) {
+	    result_t generic, special;
+	    if (!run_pattern(pattern, flags, true, generic) || !run_pattern(pattern, flags, false, special)) {
+		fprintf(stderr, "Pattern %s failed\n", pattern.name);
+		return 1;
+	    }
+
+	    const double generic_ns = ns_per_hook(generic), special_ns = ns_per_hook(special);
+	    printf("%-12s %-20s %10.1f %10.1f %+7.1f%%\n", pattern.name, FLAG_NAMES[flags], generic_ns, special_ns,
+		   100 * (generic_ns - special_ns) / generic_ns);
+	}
+    }
+    return 0;
+}
+
+static void read_baseline(const char *filename, map<string, double> &baseline) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+	fprintf(stderr, "Unable to read %s\n", filename);
+	exit(1);
+    }
+
+    char name[64];
+    double ns;
+    while (fscanf(fp, "%63s %lf", name, &ns) == 2) {
+	baseline[name] = ns;
+    }
+    fclose(fp);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-s] [-o file] [-c file [-t percent]] [pattern...]\n", program);
+    fprintf(stderr, "  -s  compare the specialized and generic hooks under every flag combination\n");
+    fprintf(stderr, "  -o  save the ns per hook of every pattern as a baseline\n");
+    fprintf(stderr, "  -c  fail if a pattern is slower than in this baseline\n");
+    fprintf(stderr, "  -t  tolerance of -c in percent (default: 10)\n");
+    fprintf(stderr, "patterns:");
+    for (uint32_t i = 0; i < NUM_PATTERNS; i++) {
+	fprintf(stderr, " %s", patterns[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+extern "C" {
+    int main(int argc, char **argv) {
+	const char *output = NULL, *compare = NULL;
+	double tolerance = 10;
+	bool specialized = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "so:c:t:h")) != -1) {
+	    switch (opt) {
+	    case 's': specialized = true; break;
+	    case 'o': output = optarg; break;
+	    case 'c': compare = optarg; break;
+	    case 't': tolerance = atof(optarg); break;
+	    default: usage(argv[0]); return 1;
+	    }
+	}
+
+	if (specialized) {
+	    return compare_hooks(optind, argc, argv);
+	}
+
+	map<string, double> baseline;
+	if (compare != NULL) {
+	    read_baseline(compare, baseline);
+	}
+
+	FILE *out = NULL;
+	if (output != NULL) {
+	    out = fopen(output, "w");
+	    if (out == NULL) {
+		fprintf(stderr, "Unable to write %s\n", output);
+		return 1;
+	    }
+	}
+
+	printf("%-12s %12s %10s %10s %10s %10s\n", "pattern", "hooks", "ns/hook", "app MB", "shadow MB", "shadow/app");
+
+	bool regressed = false;
+	for (uint32_t i = 0; i < NUM_PATTERNS; i++) {
+	    const pattern_t &pattern = patterns[i];
+	    if (!is_selected(pattern, optind, argc, argv))
+		continue;
+
+	    result_t result;
+	    if (!run_pattern(pattern, 0, false, result)) {
+		fprintf(stderr, "Pattern %s failed\n", pattern.name);
+		return 1;
+	    }
+
+	    const double ns = ns_per_hook(result);
+	    printf("%-12s %12lu %10.1f %10.1f %10.1f %10.1f", pattern.name, (unsigned long) result.hooks, ns,
+		   result.app_bytes / 1048576.0, result.shadow_bytes / 1048576.0,
+		   (double) result.shadow_bytes / result.app_bytes);
+
+	    if (baseline.count(pattern.name) != 0) {
+		const double base = baseline[pattern.name];
+		const bool slower = (ns > base * (1 + tolerance / 100));
+		printf("  %+6.1f%%%s", 100 * (ns - base) / base, slower ? "  REGRESSION" : "");
+		regressed = regressed || slower;
+	    }
+	    printf("\n");
+
+	    if (out != NULL) {
+		fprintf(out, "%s %.2f\n", pattern.name, ns);
+	    }
+	}
+
+	if (out != NULL) {
+	    fclose(out);
+	}
+	return regressed ? 1 : 0;
+    }
+}
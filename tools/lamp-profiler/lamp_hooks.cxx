@@ -1,9 +1,15 @@
 #define __STDC_FORMAT_MACROS
 
 #include "lamp_hooks.hxx"
+#include "lamp_inline.h"
 #include "../utils/MemoryMap.hxx"
 #include "../utils/LoopHierarchy.hxx"
 #include "../utils/MemoryProfile.hxx"
+#include "../utils/ValueProfile.hxx"
+#include "../utils/Locks.hxx"
+#include "../utils/EventQueue.hxx"
+#include "../utils/ProfileFormat.hxx"
+#include "../utils/RuntimeStats.hxx"
 
 #define LOAD LAMP_external_load
 #define STORE LAMP_external_store
@@ -21,12 +27,21 @@
 #include <iomanip>
 #include <fstream>
 #include <map>
+#include <string>
 #include <vector>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace Memory;
 using namespace Loop;
 using namespace Profiling;
+using namespace Locks;
+using namespace Collections;
+using namespace Stats;
 
 using namespace __gnu_cxx;
 
@@ -39,17 +54,27 @@ uint64_t LAMP_param2;
 uint64_t LAMP_param3;
 uint64_t LAMP_param4;
 
-static uint32_t external_call_id;
+// state of the inline hooks of lamp_inline.h, set up by LAMP_init
+int LAMP_inline_enabled = 0;
+lamp_shadow_page_t **LAMP_inline_pages = NULL;
+uint64_t *LAMP_inline_time_stamp = NULL;
+uint64_t LAMP_inline_loads = 0;
+uint64_t LAMP_inline_stores = 0;
 
-static uint64_t time_stamp;
+static uint64_t time_stamp; // global clock, shared by every thread so stamps stay comparable
 
+/**
+ * Shadow entry: the last store to a byte and the time stamp it was made
+ * at.  Long single-threaded runs rebase the stamps before they overflow
+ * (see rebase_time_stamps).
+ */
 typedef struct timestamp_s {
-    uint32_t instr:20;
-    uint64_t timestamp:44;
+    uint32_t instr:24;
+    uint64_t timestamp:40;
 } __attribute__((__packed__)) timestamp_t;
 
-static const uint64_t TIME_STAMP_MAX = ((1ULL << 44) - 1);
-static const uint64_t INSTR_MAX = ((1ULL << 20) - 1);
+static const uint64_t TIME_STAMP_MAX = ((1ULL << 40) - 1);
+static const uint64_t INSTR_MAX = ((1ULL << 24) - 1);
 
 bool operator==(const timestamp_t &t1, const timestamp_t &t2) {
     return *((uint64_t *) &t1) == *((uint64_t *) &t2);
@@ -59,44 +84,419 @@ static const uint64_t MAX_DEP_DIST = 2;
 
 typedef MemoryProfiler<MAX_DEP_DIST> MemoryProfilerType;
 
-static MemoryProfilerType *memoryProfiler;
+typedef ValueProfiler<MAX_DEP_DIST> ValueProfilerType;
 
-typedef MemoryNodeMap<timestamp_t> MemoryStamp;
+typedef MemoryWordMap<timestamp_t> MemoryStamp;
 
-static MemoryStamp memory_stamp; // centralized map keeping track of addr -> MemoryPage<timestamp_t>
+typedef MemoryStamp::PageType StampPage;
 
-typedef vector<DependenceSet> DependenceSets;
+/**
+ * addr -> WordPage<timestamp_t>, split into independently locked shards.
+ * Locking is only done once the multithreaded runtime is enabled; page
+ * reads and updates then take a striped lock per page, since a store
+ * splitting a uniform word rewrites both its slots and the bitmaps.
+ * The pages of all shards come from one slab arena.
+ *
+ * A direct-mapped TLB shared by all instructions and threads remembers
+ * recently found pages; entries are checked with inPage before use, so
+ * a stale or racing entry only costs a miss.
+ */
+class ShadowMemory {
+public:
+    static const uint32_t SHARD_BITS = 6;
+
+    static const uint32_t SHARDS = (1U << SHARD_BITS);
+
+    static const uint32_t PAGE_LOCKS = 1024;
+
+    static const uint32_t TLB_ENTRIES = 4096;
+
+private:
+    SlabArena<StampPage> arena;    // outlives the shards
+
+    MemoryStamp shards[SHARDS];
+
+    SpinLock shard_locks[SHARDS];
+
+    SpinLock page_locks[PAGE_LOCKS];
+
+    StampPage *tlb[TLB_ENTRIES];
+
+    bool threaded;
+
+    static uint64_t page_number(const void *addr) {
+	return StampPage::am_page_addr(addr) >> StampPage::PAGE_SHIFT;
+    }
+
+public:
+    ShadowMemory() : arena(), threaded(false) {
+	for (uint32_t i = 0; i < SHARDS; i++) {
+	    shards[i].setArena(&arena);
+	}
+	memset(tlb, 0, sizeof(tlb));
+    }
+
+    SlabArena<StampPage> &getArena() {
+	return arena;
+    }
+
+    void setThreaded(const bool threaded) {
+	this->threaded = threaded;
+    }
+
+    void setLookup(const lookup_t lookup) {
+	for (uint32_t i = 0; i < SHARDS; i++) {
+	    shards[i].setLookup(lookup, SHARD_BITS);
+	}
+    }
+
+    StampPage *get_or_create_node(const void *addr) {
+	const uint32_t shard = page_number(addr) % SHARDS;
+	if (!threaded) {
+	    return shards[shard].get_or_create_node(addr);
+	}
+
+	shard_locks[shard].lock();
+	StampPage *page = shards[shard].get_or_create_node(addr);
+	shard_locks[shard].unlock();
+	return page;
+    }
+
+    /**
+     * addr's page if the TLB holds it, else NULL.
+     */
+    StampPage *getCachedNode(const void *addr) const {
+	StampPage *page = tlb[page_number(addr) % TLB_ENTRIES];
+	return ((page != NULL) && page->inPage(addr)) ? page : NULL;
+    }
+
+    void setCachedNode(const void *addr, StampPage *page) {
+	tlb[page_number(addr) % TLB_ENTRIES] = page;
+    }
+
+    void lockPage(const StampPage *page) {
+	if (threaded) {
+	    page_locks[page_number((void *) page->getAddress()) % PAGE_LOCKS].lock();
+	}
+    }
+
+    void unlockPage(const StampPage *page) {
+	if (threaded) {
+	    page_locks[page_number((void *) page->getAddress()) % PAGE_LOCKS].unlock();
+	}
+    }
 
-typedef LoopHierarchy<DependenceSets, Loop::DEFAULT_LOOP_DEPTH, MAX_DEP_DIST> Loops;
+    StampPage *getNode(const void *addr) {
+	const uint32_t shard = page_number(addr) % SHARDS;
+	if (!threaded) {
+	    return shards[shard].getNode(addr);
+	}
 
-static Loops loop_hierarchy;
+	shard_locks[shard].lock();
+	StampPage *page = shards[shard].getNode(addr);
+	shard_locks[shard].unlock();
+	return page;
+    }
+
+    template <class S>
+    void set_invalid(const void *addr) {
+	StampPage *page = get_or_create_node(addr);
+	lockPage(page);
+	page->set_invalid(addr, sizeof(S));
+	unlockPage(page);
+    }
+
+    template <class F>
+    void forEachPage(F &f) {
+	for (uint32_t i = 0; i < SHARDS; i++) {
+	    shards[i].forEachPage(f);
+	}
+    }
+
+    void set_range_invalid(const void *addr, const uint32_t length) {
+	StampPage *page = get_or_create_node(addr);
+	lockPage(page);
+	page->set_range_invalid(addr, length);
+	unlockPage(page);
+    }
+
+    /**
+     * Invalidates freed memory and returns its page to the shard's pool
+     * once no byte of it holds a stamp.  Page caches keep pointing at the
+     * pooled page, which no longer maps any address, so their next lookup
+     * misses.  Not done once threads are enabled: loads read pages without
+     * locking and could race with the reuse.
+     */
+    void release_range(const void *addr, const uint32_t length) {
+	if (threaded) {
+	    set_range_invalid(addr, length);
+	    return;
+	}
+
+	StampPage *page = getNode(addr);
+	if (page == NULL)
+	    return;
+
+	page->set_range_invalid(addr, length);
+	if (page->any_valid())
+	    return;
+
+	shards[page_number(addr) % SHARDS].releaseNode(page);
+    }
+
+    uint64_t numPages() const {
+	uint64_t pages = 0;
+	for (uint32_t i = 0; i < SHARDS; i++) {
+	    pages += shards[i].numPages();
+	}
+	return pages;
+    }
+
+    uint64_t numReleased() const {
+	uint64_t released = 0;
+	for (uint32_t i = 0; i < SHARDS; i++) {
+	    released += shards[i].numReleased();
+	}
+	return released;
+    }
+
+    uint64_t numReused() const {
+	uint64_t reused = 0;
+	for (uint32_t i = 0; i < SHARDS; i++) {
+	    reused += shards[i].numReused();
+	}
+	return reused;
+    }
+};
+
+/**
+ * Length of the part of [addr, addr + size) that lies in addr's page.
+ */
+static uint64_t page_chunk(const uint64_t addr, const uint64_t size) {
+    const uint64_t page_size = (1ULL << StampPage::PAGE_SHIFT);
+    const uint64_t in_page = page_size - (addr & (page_size - 1));
+    return (size < in_page) ? size : in_page;
+}
+
+static ShadowMemory memory_stamp; // centralized map keeping track of addr -> WordPage<timestamp_t>
+
+// each loop frame holds the epoch of its current iteration, see start_epoch
+typedef LoopHierarchy<uint64_t, Loop::DEFAULT_LOOP_CHUNK, MAX_DEP_DIST> Loops;
 
 typedef Loops::LoopInfoType LoopInfoType;
 
-class Pages {    // for each instruction to track the recently accessed page
-private:         // if the accessed page is changed -> go to memory_stamp to get 
-    MemoryPage<timestamp_t> *stampPage;
+/**
+ * For each instruction, its recently accessed pages, most recent first,
+ * so an instruction alternating between a few arrays keeps hitting.  On
+ * a miss the page comes from memory_stamp.
+ */
+class Pages {
+public:
+    static const uint32_t WAYS = 4;
+
+private:
+    StampPage *ways[WAYS];
 
 public:
-    Pages() : stampPage(NULL) {}
+    Pages() {
+	for (uint32_t i = 0; i < WAYS; i++) {
+	    ways[i] = NULL;
+	}
+    }
 
-    Pages(MemoryStamp &stampMemory) 
-	: stampPage(stampMemory.get_or_create_node((void *) NULL)) {}
+    Pages(ShadowMemory &stampMemory) {
+	StampPage *page = stampMemory.get_or_create_node((void *) NULL);
+	for (uint32_t i = 0; i < WAYS; i++) {
+	    ways[i] = page;
+	}
+    }
+
+    /**
+     * Moves addr's page to the front; false if it is not cached.
+     */
+    bool findStampPage(const void *addr) {
+	if (ways[0]->inPage(addr))
+	    return true;
+
+	for (uint32_t i = 1; i < WAYS; i++) {
+	    if (ways[i]->inPage(addr)) {
+		StampPage *page = ways[i];
+		for (; i > 0; i--) {
+		    ways[i] = ways[i - 1];
+		}
+		ways[0] = page;
+		return true;
+	    }
+	}
+	return false;
+    }
 
-    void setStampPage(MemoryPage<timestamp_t> *page) {
+    /**
+     * Puts page in front, evicting the least recently used one.
+     */
+    void setStampPage(StampPage *page) {
 	if (page == NULL)
 	    abort();
-	this->stampPage = page;
+	for (uint32_t i = WAYS - 1; i > 0; i--) {
+	    ways[i] = ways[i - 1];
+	}
+	ways[0] = page;
     }
 
-    MemoryPage<timestamp_t> *getStampPage() {
-	return this->stampPage;
+    StampPage *getStampPage() {
+	return ways[0];
     }
 };
 
 typedef vector<Pages> PageCache;   
 
-static PageCache pageCache;    
+enum lamp_event_kind_t {
+    EVENT_LOAD = 0,
+    EVENT_STORE,
+    EVENT_EXTERNAL_LOAD,
+    EVENT_EXTERNAL_STORE,
+    EVENT_ALLOCATE,
+    EVENT_DEALLOCATE,
+    EVENT_LOOP_INVOCATION,
+    EVENT_LOOP_ITERATION,
+    EVENT_LOOP_EXIT,
+    EVENT_SAMPLE_BURST
+};
+
+/**
+ * One hook call as recorded by the asynchronous runtime.  For loop events
+ * instr is the loop id and addr the time stamp drawn by the hook; ranges
+ * longer than EVENT_SIZE_MAX are recorded as several events.  Loads and
+ * stores carry no time stamp: they reach the shared shadow memory when
+ * they are applied, not when the hook ran (see analysis_thread).
+ */
+typedef struct lamp_event_s {
+    uint64_t addr;
+    uint32_t instr;
+    uint16_t size;
+    uint16_t kind;
+} lamp_event_t;
+
+static const uint64_t EVENT_SIZE_MAX = ((1ULL << 16) - 1);
+
+typedef EventQueue<lamp_event_t> EventBuffer;
+
+/**
+ * Sampling runs each thread through repeating periods of loop iterations
+ * (or invocations).  A period skips most of its ticks, recording neither
+ * loads nor stores, then warms up for one tick that only records stores,
+ * then traces a burst of ticks in full.  Stamps older than the warm-up
+ * were left by an earlier burst and are ignored.
+ */
+enum lamp_sample_phase_t {
+    SAMPLE_SKIP = 0,
+    SAMPLE_WARMUP,
+    SAMPLE_TRACE
+};
+
+/**
+ * Everything a profiled thread updates on its own: its loop stack, page
+ * cache, current time stamp and dependence counts.  The per-thread
+ * profiles are merged in LAMP_finish.
+ */
+class ThreadState {
+public:
+    Loops loop_hierarchy;
+
+    PageCache pageCache;
+
+    MemoryProfilerType *memoryProfiler;
+
+    uint64_t time_stamp;
+
+    uint64_t iteration_epoch;    // last epoch given to a loop iteration, see start_epoch
+
+    uint32_t external_call_id;
+
+    int64_t dyn_stores, dyn_loads;
+
+    EventBuffer *events;    // only used by the asynchronous runtime
+
+    // only used when sampling
+    uint32_t sample_phase;
+    uint64_t sample_countdown;
+    uint64_t trace_start;
+    vector<uint64_t> executed_loads;
+    vector<uint64_t> traced_loads;
+
+    // only used with target loops; kept by the hooks, not the analysis
+    uint32_t loop_depth;
+    uint32_t target_depth;  // depth of the outermost active target loop, 0 if none
+
+    // only used with snapshots
+    uint32_t id;            // index in threads
+    uint32_t snapshot_epoch;
+    vector<Dependence> snapshot_changes;    // dirty profiles, see take_snapshot
+    SnapshotFrame snapshot_frame;
+
+    // points into the live stats segment when there is one
+    stats_slot_t *stats;
+    stats_slot_t local_stats;
+
+    // only used with value profiling; the loop stack is kept by the hooks
+    ValueProfilerType *valueProfiler;
+    vector<uint32_t> value_loops;
+    vector<uint64_t> value_invocations;
+    uint64_t num_invocations;
+
+    ThreadState() : loop_hierarchy(), pageCache(), memoryProfiler(NULL),
+		    time_stamp(0), iteration_epoch(0), external_call_id(0), dyn_stores(0), dyn_loads(0),
+		    events(NULL), sample_phase(SAMPLE_TRACE), sample_countdown(0), trace_start(0),
+		    executed_loads(), traced_loads(), loop_depth(0), target_depth(0),
+		    id(0), snapshot_epoch(0), snapshot_changes(), snapshot_frame(), stats(&local_stats), valueProfiler(NULL),
+		    value_loops(), value_invocations(), num_invocations(0) {
+	memset(&local_stats, 0, sizeof(local_stats));
+    }
+
+    void initialize(const uint32_t num_instrs, const uint64_t start_time_stamp, const bool buffered,
+		    const bool values) {
+	memoryProfiler = new MemoryProfilerType(num_instrs);
+
+	if (values) {
+	    valueProfiler = new ValueProfilerType(num_instrs);
+	    value_loops.push_back(0);
+	    value_invocations.push_back(0);
+	}
+
+	if (buffered) {
+	    events = new EventBuffer();
+	}
+
+	// timestamp 0 is the special first "iteration" of main
+	loop_hierarchy.loopIteration(0);
+
+	loop_hierarchy.getCurrentLoop().setItem(++iteration_epoch);
+
+	time_stamp = start_time_stamp;
+
+	pageCache = PageCache(num_instrs);
+	Pages pages(memory_stamp);
+	for (uint32_t i = 0; i < num_instrs; i++) {
+	    pageCache[i] = pages;
+	}
+    }
+};
+
+static ThreadState main_thread;
+
+static __thread ThreadState *thread_state;
+
+static vector<ThreadState *> threads;   // every thread that has touched the runtime
+
+static Mutex threads_lock;
+
+static uint32_t lamp_num_instrs;
+
+static vector<bool> target_loops;   // indexed by loop id, only used with target loops
+
+static void start_analysis_threads(uint32_t num_threads);
+
+static void stop_analysis_threads();
 
 
 /***** struct defs *****/
@@ -110,6 +510,22 @@ typedef struct _lamp_params_t {
     bool measure_iterations;
     bool profile_flow;
     bool profile_output;
+    bool direct_shadow;
+    bool huge_pages;
+    bool threaded;
+    uint32_t analysis_threads;
+    bool binary_output;
+    bool compress_output;
+    bool sampling;
+    bool sample_invocations;
+    uint64_t sample_period;
+    uint64_t sample_burst;
+    bool target_loops;
+    bool snapshots;
+    uint64_t snapshot_interval;
+    int snapshot_signal;
+    bool live_stats;
+    bool profile_values;
 } lamp_params_t;
 
 typedef struct _lamp_stats_t {
@@ -117,12 +533,118 @@ typedef struct _lamp_stats_t {
     int64_t dyn_stores, dyn_loads, num_sync_arcs;
     int64_t calls_to_qhash;
     uint32_t nest_depth;
+    uint32_t rebases;
 } lamp_stats_t;
 
 
 static lamp_params_t lamp_params;
 static lamp_stats_t lamp_stats;
 
+/**
+ * The load and store hooks are compiled for every combination of the
+ * flags below; LAMP_init installs the variant for its lamp_params once
+ * the runtime is up, so those hooks do not test the flags on each call.
+ * The HOOKS_GENERIC variant reads lamp_params and serves until then,
+ * and the asynchronous analysis and range hooks keep using it.  It is
+ * also the only variant that checks for value profiling, sampling,
+ * target loops, live stats, analysis threads and snapshots; LAMP_init
+ * keeps it installed when any of those is on.
+ */
+enum hook_config_t {
+    HOOKS_OUTPUT = 0x1,         // profile output instead of flow dependences
+    HOOKS_ITERATIONS = 0x2,
+    HOOKS_SILENT_STORES = 0x4,
+    HOOKS_GENERIC = 0x8
+};
+
+template <uint32_t C>
+static inline bool hooks_initialized() {
+    return ((C & HOOKS_GENERIC) == 0) || LAMP_initialized;
+}
+
+template <uint32_t C>
+static inline bool hooks_flow() {
+    return ((C & HOOKS_GENERIC) != 0) ? lamp_params.profile_flow : ((C & HOOKS_OUTPUT) == 0);
+}
+
+template <uint32_t C>
+static inline bool hooks_output() {
+    return ((C & HOOKS_GENERIC) != 0) ? lamp_params.profile_output : ((C & HOOKS_OUTPUT) != 0);
+}
+
+template <uint32_t C>
+static inline bool hooks_iterations() {
+    return ((C & HOOKS_GENERIC) != 0) ? lamp_params.measure_iterations : ((C & HOOKS_ITERATIONS) != 0);
+}
+
+template <uint32_t C>
+static inline bool hooks_silent_stores() {
+    return ((C & HOOKS_GENERIC) != 0) ? lamp_params.silent_stores : ((C & HOOKS_SILENT_STORES) != 0);
+}
+
+template <uint32_t C>
+static inline bool hooks_generic() {
+    return (C & HOOKS_GENERIC) != 0;
+}
+
+static bool hooks_need_generic() {
+    return lamp_params.profile_values || lamp_params.sampling || lamp_params.target_loops || lamp_params.live_stats
+	|| (lamp_params.analysis_threads > 0) || lamp_params.snapshots;
+}
+
+static uint32_t hooks_config() {
+    return (lamp_params.profile_output ? HOOKS_OUTPUT : 0) | (lamp_params.measure_iterations ? HOOKS_ITERATIONS : 0)
+	| (lamp_params.silent_stores ? HOOKS_SILENT_STORES : 0);
+}
+
+template <class T, uint32_t C>
+void LAMP_load(const uint32_t instr, const uint64_t addr);
+
+template <class T, uint32_t C>
+void LAMP_store(uint32_t instrID, uint64_t addr, uint64_t value);
+
+typedef void (*load_hook_t)(const uint32_t instr, const uint64_t addr);
+
+typedef void (*store_hook_t)(uint32_t instr, uint64_t addr, uint64_t value);
+
+typedef struct hook_table_s {
+    load_hook_t load1, load2, load4, load8;
+    store_hook_t store1, store2, store4, store8;
+} hook_table_t;
+
+static hook_table_t hooks = {
+    LAMP_load<uint8_t, HOOKS_GENERIC>, LAMP_load<uint16_t, HOOKS_GENERIC>,
+    LAMP_load<uint32_t, HOOKS_GENERIC>, LAMP_load<uint64_t, HOOKS_GENERIC>,
+    LAMP_store<uint8_t, HOOKS_GENERIC>, LAMP_store<uint16_t, HOOKS_GENERIC>,
+    LAMP_store<uint32_t, HOOKS_GENERIC>, LAMP_store<uint64_t, HOOKS_GENERIC>
+};
+
+template <uint32_t C>
+static hook_table_t hook_table() {
+    const hook_table_t table = {
+	LAMP_load<uint8_t, C>, LAMP_load<uint16_t, C>, LAMP_load<uint32_t, C>, LAMP_load<uint64_t, C>,
+	LAMP_store<uint8_t, C>, LAMP_store<uint16_t, C>, LAMP_store<uint32_t, C>, LAMP_store<uint64_t, C>
+    };
+    return table;
+}
+
+/**
+ * The table of the given config, among the configs below C.
+ */
+template <uint32_t C>
+struct HookSelector {
+    static hook_table_t select(const uint32_t config) {
+	return (config == C - 1) ? hook_table<C - 1>() : HookSelector<C - 1>::select(config);
+    }
+};
+
+template <>
+struct HookSelector<0> {
+    static hook_table_t select(const uint32_t config) {
+	return hook_table<HOOKS_GENERIC>();
+    }
+};
+
 struct nullstream: std::ostream {
     struct nullbuf: std::streambuf {
 	int overflow(int c) { return traits_type::not_eof(c); }
@@ -141,15 +663,491 @@ static ostream &debug() {
     }
 }
 
+static void initialize_sampling(ThreadState &thread) {
+    if (!lamp_params.sampling)
+	return;
+
+    // every thread starts with a burst, there are no stale stamps yet
+    thread.sample_phase = SAMPLE_TRACE;
+    thread.sample_countdown = lamp_params.sample_burst;
+    thread.trace_start = 0;
+    thread.executed_loads.assign(lamp_num_instrs, 0);
+    thread.traced_loads.assign(lamp_num_instrs, 0);
+}
+
+/***** live stats *****/
+
+static stats_segment_t *stats_segment = NULL;
+
+static const uint32_t STATS_PUBLISH_MS = 250;
+
+static void attach_stats(ThreadState &thread) {
+    if (stats_segment == NULL)
+	return;
+
+    thread.stats = &(stats_segment->slots[thread.id % STATS_SLOTS]);
+    __sync_add_and_fetch(&(stats_segment->num_threads), 1);
+}
+
+/**
+ * Times one hook call into the thread's slot.  Only done with live stats;
+ * the check is kept off the hooks' fast path, which it otherwise slows by
+ * several percent, and the specialized load and store hooks pass a
+ * constant false.
+ */
+class HookTimer {
+private:
+    stats_slot_t *slot;
+
+    const uint32_t hook;
+
+    uint64_t start;
+
+    __attribute__((noinline, cold)) void stop() {
+	slot->hook_calls[hook]++;
+	slot->hook_cycles[hook] += read_cycles() - start;
+    }
+
+public:
+    HookTimer(ThreadState &thread, const uint32_t hook, const bool timed = lamp_params.live_stats)
+	: slot(NULL), hook(hook), start(0) {
+	if (__builtin_expect(timed, 0)) {
+	    slot = thread.stats;
+	    start = read_cycles();
+	}
+    }
+
+    ~HookTimer() {
+	if (__builtin_expect(slot != NULL, 0)) {
+	    stop();
+	}
+    }
+};
+
+static void publish_stats() {
+    const SlabArena<StampPage> &arena = memory_stamp.getArena();
+    stats_segment->gauges[SHADOW_PAGES] = memory_stamp.numPages();
+    stats_segment->gauges[SHADOW_RECLAIMED] = memory_stamp.numReleased();
+    stats_segment->gauges[SHADOW_REUSED] = memory_stamp.numReused();
+    stats_segment->gauges[ARENA_BYTES] = arena.mappedBytes();
+    stats_segment->gauges[TIME_STAMP] = time_stamp;
+    stats_segment->heartbeat_ns = read_ns();
+    stats_segment->heartbeat_cycles = read_cycles();
+}
+
+static void *stats_publisher(void *arg) {
+    while (true) {
+	usleep(STATS_PUBLISH_MS * 1000);
+	publish_stats();
+    }
+    return NULL;
+}
+
+/**
+ * Creates /dev/shm/lamp-stats.<pid> for lamp-top.  The runtime keeps going
+ * without live stats if it cannot.
+ */
+static void start_live_stats() {
+    stats_segment = create_stats_segment(getpid());
+    if (stats_segment == NULL) {
+	fprintf(stderr, "Unable to create the LAMP stats segment, no live stats\n");
+	lamp_params.live_stats = false;
+	return;
+    }
+    stats_segment->timed = 1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_publisher, NULL) != 0) {
+	fprintf(stderr, "Unable to create LAMP stats thread\n");
+	abort();
+    }
+    pthread_detach(thread);
+}
+
+static void finish_live_stats() {
+    publish_stats();
+    stats_segment->finished = 1;
+
+    // lamp-top keeps its mapping of the final counts
+    char path[64];
+    stats_segment_path(stats_segment->pid, path, sizeof(path));
+    unlink(path);
+}
+
+static ThreadState &attach_thread() {
+    if (!lamp_params.threaded) {
+	thread_state = &main_thread;
+	return main_thread;
+    }
+
+    ThreadState *state = new ThreadState();
+    state->initialize(lamp_num_instrs, __sync_add_and_fetch(&time_stamp, 1), (lamp_params.analysis_threads > 0),
+		      lamp_params.profile_values);
+    initialize_sampling(*state);
+
+    threads_lock.lock();
+    state->id = threads.size();
+    threads.push_back(state);
+    threads_lock.unlock();
+    attach_stats(*state);
+
+    thread_state = state;
+    return *state;
+}
+
+static inline ThreadState &current_thread() {
+    ThreadState *state = thread_state;
+    if (state == NULL) {
+	return attach_thread();
+    }
+    return *state;
+}
+
+/**
+ * The analysis only compares time stamps and tests shadow entries for
+ * equality, so a rebase replaces every live stamp -- in the shadow memory,
+ * the loop stack and the sampling state -- by its rank among all of them.
+ */
+class TimeStampCollector {
+public:
+    vector<uint64_t> stamps;
+
+    TimeStampCollector() : stamps() {}
+
+    uint64_t operator()(const uint64_t stamp) {
+	stamps.push_back(stamp);
+	return stamp;
+    }
+
+    void operator()(timestamp_t &item) {
+	// neighbouring slots are usually written by the same store
+	if (stamps.empty() || (stamps.back() != item.timestamp)) {
+	    stamps.push_back(item.timestamp);
+	}
+    }
+
+    void operator()(StampPage &page) {
+	page.updateItems(*this);
+    }
+};
+
+class TimeStampRebaser {
+private:
+    const vector<uint64_t> &ranks;
+
+public:
+    TimeStampRebaser(const vector<uint64_t> &ranks) : ranks(ranks) {}
+
+    uint64_t operator()(const uint64_t stamp) {
+	return lower_bound(ranks.begin(), ranks.end(), stamp) - ranks.begin();
+    }
+
+    void operator()(timestamp_t &item) {
+	item.timestamp = (*this)(item.timestamp);
+    }
+
+    void operator()(StampPage &page) {
+	page.updateItems(*this);
+    }
+};
+
+/**
+ * Compacts the clock once it reaches TIME_STAMP_MAX.  Only the synchronous
+ * single-threaded runtime can do this; other threads may hold or have
+ * buffered stamps of the old epoch.
+ */
+static void rebase_time_stamps() {
+    if (lamp_params.threaded || (lamp_params.analysis_threads > 0)) {
+	fprintf(stderr, "TIME STAMP too large, stamps are only rebased by the synchronous single-threaded runtime\n");
+	abort();
+    }
+
+    ThreadState &thread = main_thread;
+    TimeStampCollector collector;
+    collector(0);    // unused iteration slots, keeps rank 0
+    collector(time_stamp);
+    collector(thread.time_stamp);
+    collector(thread.trace_start);
+    thread.loop_hierarchy.mapTimeStamps(collector);
+    memory_stamp.forEachPage(collector);
+
+    vector<uint64_t> &ranks = collector.stamps;
+    sort(ranks.begin(), ranks.end());
+    ranks.erase(unique(ranks.begin(), ranks.end()), ranks.end());
+
+    TimeStampRebaser rebaser(ranks);
+    memory_stamp.forEachPage(rebaser);
+    thread.loop_hierarchy.mapTimeStamps(rebaser);
+    thread.trace_start = rebaser(thread.trace_start);
+    thread.time_stamp = rebaser(thread.time_stamp);
+    time_stamp = rebaser(time_stamp);
+
+    if (time_stamp >= TIME_STAMP_MAX) {
+	fprintf(stderr, "TIME STAMP too large, %lu live stamps after rebasing\n", (unsigned long) ranks.size());
+	abort();
+    }
+
+    lamp_stats.rebases++;
+}
+
+static uint64_t next_time_stamp() {
+    if (lamp_params.threaded) {
+	return __sync_add_and_fetch(&time_stamp, 1);
+    }
+    if (time_stamp >= TIME_STAMP_MAX) {
+	rebase_time_stamps();
+    }
+    return ++time_stamp;
+}
+
+/***** snapshots *****/
+
+static const char *SNAPSHOT_FILE = "result.lamp.snapshot";
+
+static SnapshotWriter snapshot_writer;
+
+static Mutex snapshot_lock;
+
+static uint32_t snapshot_requests = 0;  // bumped by the timer and by the snapshot signal
+
+static struct sigaction previous_snapshot_action;    // the program's handler, called after ours
+
+static void request_snapshot() {
+    __sync_add_and_fetch(&snapshot_requests, 1);
+}
+
+static void snapshot_signal(int signal, siginfo_t *info, void *context) {
+    request_snapshot();
+
+    const struct sigaction &previous = previous_snapshot_action;
+    if ((previous.sa_flags & SA_SIGINFO) != 0) {
+	if (previous.sa_sigaction != NULL) {
+	    previous.sa_sigaction(signal, info, context);
+	}
+    } else if ((previous.sa_handler != SIG_DFL) && (previous.sa_handler != SIG_IGN)) {
+	previous.sa_handler(signal);
+    }
+}
+
+static void *snapshot_timer(void *arg) {
+    while (true) {
+	sleep(lamp_params.snapshot_interval);
+	request_snapshot();
+    }
+    return NULL;
+}
+
+/**
+ * Snapshots are requested asynchronously, but each thread's profile is
+ * logged by whoever updates it -- the thread itself or its analysis
+ * thread -- at its next loop iteration, so it is never read mid-update.
+ */
+static void start_snapshots() {
+    if (!snapshot_writer.open(SNAPSHOT_FILE, lamp_num_instrs)) {
+	fprintf(stderr, "Unable to create %s\n", SNAPSHOT_FILE);
+	abort();
+    }
+
+    // a handler the program installs later replaces ours
+    if (lamp_params.snapshot_signal != 0) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = snapshot_signal;
+	action.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(lamp_params.snapshot_signal, &action, &previous_snapshot_action) != 0) {
+	    fprintf(stderr, "Unable to handle signal %d for LAMP snapshots\n", lamp_params.snapshot_signal);
+	    abort();
+	}
+    }
+
+    if (lamp_params.snapshot_interval > 0) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, snapshot_timer, NULL) != 0) {
+	    fprintf(stderr, "Unable to create LAMP snapshot thread\n");
+	    abort();
+	}
+	pthread_detach(thread);
+    }
+}
+
+/**
+ * Logs the profiles the thread changed since its previous snapshot.  The
+ * frame is encoded from the thread's list of dirty profiles outside the
+ * lock, so a snapshot costs what changed, not the size of the profile.
+ */
+static void take_snapshot(ThreadState &thread, const bool final) {
+    SnapshotFrame &frame = thread.snapshot_frame;
+    frame.clear();
+    for (uint32_t i = 0; i < thread.snapshot_changes.size(); i++) {
+	const Dependence &dep = thread.snapshot_changes[i];
+	MemoryProfile &profile = thread.memoryProfiler->getProfile(dep);
+	profile.setDirty(false);
+	frame.add(dep, profile);
+    }
+    thread.snapshot_changes.clear();
+
+    snapshot_lock.lock();
+    if (lamp_params.snapshots && !snapshot_writer.write(thread.id, frame, final)) {
+	fprintf(stderr, "Unable to write %s, no further snapshots\n", SNAPSHOT_FILE);
+	lamp_params.snapshots = false;
+    }
+    snapshot_lock.unlock();
+}
+
+static inline void poll_snapshot(ThreadState &thread) {
+    const uint32_t requests = __atomic_load_n(&snapshot_requests, __ATOMIC_RELAXED);
+    if (__builtin_expect(thread.snapshot_epoch != requests, 0)) {
+	thread.snapshot_epoch = requests;
+	take_snapshot(thread, false);
+    }
+}
+
 void LAMP_print_stats(ofstream &stream) {
+    lamp_stats.dyn_stores = 0;
+    lamp_stats.dyn_loads = 0;
+    uint32_t max_depth = 0;
+    for (uint32_t i = 0; i < threads.size(); i++) {
+	lamp_stats.dyn_stores += threads[i]->dyn_stores;
+	lamp_stats.dyn_loads += threads[i]->dyn_loads;
+	max_depth = max(max_depth, threads[i]->loop_hierarchy.max_depth);
+    }
+    lamp_stats.dyn_stores += LAMP_inline_stores;
+    lamp_stats.dyn_loads += LAMP_inline_loads;
+
     stream<<setprecision(3);
     stream<<"run_time: "<<1.0*(clock()-lamp_stats.start_time)/CLOCKS_PER_SEC<<endl;
     stream<<"Num dynamic stores: "<<lamp_stats.dyn_stores<<endl;
     stream<<"Num dynamic loads: "<<lamp_stats.dyn_loads<<endl;
-    stream<<"Max loop nest depth: "<<loop_hierarchy.max_depth<<endl;
+    stream<<"Max loop nest depth: "<<max_depth<<endl;
+    stream<<"Num threads: "<<threads.size()<<endl;
+    stream<<"Analysis threads: "<<lamp_params.analysis_threads<<endl;
+    stream<<"Shadow lookup: "<<(lamp_params.direct_shadow ? "direct" : "hashed")<<endl;
+    stream<<"Shadow pages: "<<memory_stamp.numPages()<<" live, "<<memory_stamp.numReleased()<<" reclaimed, "
+	  <<memory_stamp.numReused()<<" reused"<<endl;
+
+    const SlabArena<StampPage> &arena = memory_stamp.getArena();
+    stream<<"Shadow arena: "<<(arena.mappedBytes() >> 20)<<" MB in "<<arena.numSlabs()<<" slabs, "
+	  <<arena.numAllocations()<<" allocations, "<<arena.numRecycled()<<" recycled, "
+	  <<(arena.hugePageBytes() >> 20)<<" MB in huge pages"
+	  <<(arena.getHugePages() ? "" : " (not requested)")<<endl;
+
+    if (LAMP_inline_enabled) {
+	stream<<"Inline hooks: "<<LAMP_inline_loads<<" loads, "<<LAMP_inline_stores<<" stores"<<endl;
+    }
+
+    if (lamp_stats.rebases > 0) {
+	stream<<"Time stamp rebases: "<<lamp_stats.rebases<<endl;
+    }
+
+    stats_slot_t total;
+    if (stats_segment != NULL) {
+	sum_slots(stats_segment, total);
+    } else {
+	memset(&total, 0, sizeof(total));
+	for (uint32_t i = 0; i < threads.size(); i++) {
+	    for (uint32_t j = 0; j < COUNTERS; j++) {
+		total.counters[j] += threads[i]->stats->counters[j];
+	    }
+	}
+    }
+    stream<<"Page cache: "<<total.counters[PAGE_CACHE_HITS]<<" hits, "<<total.counters[PAGE_CACHE_MISSES]<<" misses, "
+	  <<total.counters[SHADOW_TLB_HITS]<<" shadow TLB hits, "<<total.counters[SHADOW_LOOKUPS]<<" shadow lookups"<<endl;
+    stream<<"Dependences recorded: "<<total.counters[DEPENDENCES]<<", unaligned splits: "
+	  <<total.counters[UNALIGNED_SPLITS]<<endl;
+    stream<<"External bytes: "<<total.counters[EXTERNAL_LOAD_BYTES]<<" loaded, "
+	  <<total.counters[EXTERNAL_STORE_BYTES]<<" stored"<<endl;
+    if (lamp_params.live_stats) {
+	stream<<"Hook cycles:";
+	for (uint32_t i = 0; i < HOOK_CLASSES; i++) {
+	    stream<<" "<<HOOK_NAMES[i]<<" "<<total.hook_cycles[i]<<" ("<<total.hook_calls[i]<<" calls)"
+		  <<((i + 1 < HOOK_CLASSES) ? "," : "");
+	}
+	stream<<endl;
+    }
+
+    if (lamp_params.target_loops) {
+	stream<<"Target loops: "<<count(target_loops.begin(), target_loops.end(), true)<<endl;
+    }
+
+    if (lamp_params.snapshots) {
+	stream<<"Snapshots: "<<snapshot_writer.numFrames()<<" frames, "<<snapshot_writer.numRecords()<<" records, "
+	      <<(snapshot_writer.numBytes() >> 10)<<" KB"<<endl;
+    }
+
+    if (lamp_params.sampling) {
+	uint64_t executed = 0, traced = 0;
+	for (uint32_t i = 0; i < main_thread.executed_loads.size(); i++) {
+	    executed += main_thread.executed_loads[i];
+	    traced += main_thread.traced_loads[i];
+	}
+	stream<<"Sampling: "<<lamp_params.sample_burst<<" of every "<<lamp_params.sample_period
+	      <<(lamp_params.sample_invocations ? " loop invocations" : " loop iterations")<<endl;
+	stream<<"Sampled loads: "<<traced<<" of "<<executed<<endl;
+    }
+}
+
+/**
+ * Adds the loop ids listed in ids, separated by commas or white space.
+ */
+static void parse_target_loops(const char *ids) {
+    const char *delimiters = ", \t\r\n";
+    char *list = strdup(ids);
+    char *state = NULL;
+    for (char *id = strtok_r(list, delimiters, &state); id != NULL; id = strtok_r(NULL, delimiters, &state)) {
+	const unsigned long long loop = strtoull(id, NULL, 0);
+	if (loop > PROFILE_LOOP_MAX) {
+	    cerr<<"Target loop id too high "<<loop<<" > "<<PROFILE_LOOP_MAX<<endl;
+	    abort();
+	}
+	if (loop >= target_loops.size()) {
+	    target_loops.resize(loop + 1, false);
+	}
+	target_loops[loop] = true;
+    }
+    free(list);
+}
+
+static void read_target_loops(const char *filename) {
+    ifstream file(filename);
+    if (!file) {
+	cerr<<"Unable to read target loops from "<<filename<<endl;
+	abort();
+    }
+
+    string line;
+    while (getline(file, line)) {
+	parse_target_loops(line.c_str());
+    }
 }
 
 /***** functions *****/
+/**
+ * Lets the inline hooks work on the main thread's page cache and clock
+ * when the runtime does nothing else on a load or store.
+ */
+static void start_inline_hooks() {
+    if (lamp_params.threaded || (lamp_params.analysis_threads > 0) || !lamp_params.profile_flow
+	|| lamp_params.silent_stores || lamp_params.sampling || lamp_params.target_loops
+	|| lamp_params.profile_values || lamp_params.live_stats)
+	return;
+
+    timestamp_t stamp;
+    stamp.instr = 3;
+    stamp.timestamp = 5;
+    uint64_t bits;
+    memcpy(&bits, &stamp, sizeof(bits));
+    if ((sizeof(lamp_shadow_page_t) != sizeof(StampPage)) || (sizeof(Pages) != LAMP_PAGE_CACHE_WAYS * sizeof(void *))
+	|| (bits != ((5ULL << 24) | 3))) {
+	fprintf(stderr, "lamp_inline.h does not match the runtime's shadow memory\n");
+	abort();
+    }
+
+    LAMP_inline_pages = (lamp_shadow_page_t **) &(main_thread.pageCache[0]);
+    LAMP_inline_time_stamp = &(main_thread.time_stamp);
+    LAMP_inline_enabled = 1;
+}
+
 void LAMP_init(uint32_t num_instrs, uint32_t num_loops, uint64_t mem_gran, uint64_t flags) {
     lamp_params.lamp_out = new ofstream("result.lamp.profile");
     lamp_params.lamp_out2 = new ofstream("result.lamp.iter_cnt");
@@ -172,22 +1170,139 @@ void LAMP_init(uint32_t num_instrs, uint32_t num_loops, uint64_t mem_gran, uint6
         lamp_params.mem_gran_shift+=1;
     }
 
-    lamp_params.silent_stores = false;
-    if (((flags & 0x1) != 0) || (getenv("LAMP_PROFILE_SILENT_STORES") != NULL)) {
-        lamp_params.silent_stores = true;
+    lamp_params.silent_stores = false;
+    if (((flags & 0x1) != 0) || (getenv("LAMP_PROFILE_SILENT_STORES") != NULL)) {
+        lamp_params.silent_stores = true;
+    }
+
+    lamp_params.measure_iterations = false;
+    if (((flags & 0x2) != 0) || (getenv("LAMP_PROFILE_MEASURE_ITERATIONS") != NULL)) {
+        lamp_params.measure_iterations = true;
+    }
+
+    lamp_params.profile_flow = true;
+
+    lamp_params.profile_output = false;
+    if (((flags & 0x4) != 0) || (getenv("LAMP_PROFILE_PROFILE_OUTPUT") != NULL)) {
+        lamp_params.profile_output = true;
+        lamp_params.profile_flow = false;
+    }
+
+    lamp_params.direct_shadow = false;
+    if (((flags & 0x8) != 0) || (getenv("LAMP_PROFILE_DIRECT_SHADOW") != NULL)) {
+	lamp_params.direct_shadow = true;
+	memory_stamp.setLookup(DIRECT);
+    }
+
+    // Back the shadow page slabs with transparent huge pages
+    lamp_params.huge_pages = false;
+    if (((flags & 0x200) != 0) || (getenv("LAMP_PROFILE_HUGE_PAGES") != NULL)) {
+	lamp_params.huge_pages = true;
+	memory_stamp.getArena().setHugePages(true);
+    }
+
+    lamp_params.threaded = false;
+    if (((flags & 0x10) != 0) || (getenv("LAMP_PROFILE_THREADS") != NULL)) {
+	lamp_params.threaded = true;
+	memory_stamp.setThreaded(true);
+    }
+
+    // Buffered hooks hand their events to separate analysis threads, which
+    // requires the thread-safe shadow and a buffer per program thread; only
+    // dependences within a thread are exact, see analysis_thread
+    lamp_params.analysis_threads = 0;
+    if (((flags & 0x20) != 0) || (getenv("LAMP_PROFILE_ASYNC") != NULL)) {
+	const char *analysis_threads = getenv("LAMP_PROFILE_ASYNC");
+	lamp_params.analysis_threads = (analysis_threads != NULL) ? atoi(analysis_threads) : 0;
+	if (lamp_params.analysis_threads == 0) {
+	    lamp_params.analysis_threads = 1;
+	}
+	lamp_params.threaded = true;
+	memory_stamp.setThreaded(true);
+    }
+
+    lamp_params.binary_output = false;
+    if (((flags & 0x40) != 0) || (getenv("LAMP_PROFILE_BINARY") != NULL)) {
+	lamp_params.binary_output = true;
+    }
+
+    lamp_params.compress_output = false;
+    if (((flags & 0x80) != 0) || (getenv("LAMP_PROFILE_COMPRESS") != NULL)) {
+	lamp_params.binary_output = true;
+	lamp_params.compress_output = true;
+    }
+
+    // LAMP_PROFILE_SAMPLE_PERIOD=<n> traces LAMP_PROFILE_SAMPLE_BURST=<m>
+    // loop iterations out of every n
+    lamp_params.sampling = false;
+    lamp_params.sample_invocations = false;
+    lamp_params.sample_period = 100;
+    lamp_params.sample_burst = 10;
+    if (((flags & 0x100) != 0) || (getenv("LAMP_PROFILE_SAMPLE_PERIOD") != NULL)) {
+	const char *period = getenv("LAMP_PROFILE_SAMPLE_PERIOD");
+	const char *burst = getenv("LAMP_PROFILE_SAMPLE_BURST");
+	lamp_params.sampling = true;
+	if ((period != NULL) && (atoll(period) > 0)) {
+	    lamp_params.sample_period = atoll(period);
+	}
+	if ((burst != NULL) && (atoll(burst) > 0)) {
+	    lamp_params.sample_burst = atoll(burst);
+	}
+	if (getenv("LAMP_PROFILE_SAMPLE_INVOCATIONS") != NULL) {
+	    lamp_params.sample_invocations = true;
+	}
+
+	// leave room for the warm-up tick and at least one skipped tick
+	if (lamp_params.sample_period < lamp_params.sample_burst + 2) {
+	    cerr<<"LAMP sample period "<<lamp_params.sample_period<<" too short for burst "
+		<<lamp_params.sample_burst<<", using "<<(lamp_params.sample_burst + 2)<<endl;
+	    lamp_params.sample_period = lamp_params.sample_burst + 2;
+	}
+    }
+
+    // Only loads made inside one of the listed loops are profiled; stores are
+    // always stamped so dependences into a target loop are still seen
+    lamp_params.target_loops = false;
+    if ((getenv("LAMP_PROFILE_TARGET_LOOPS") != NULL) || (getenv("LAMP_PROFILE_TARGET_LOOPS_FILE") != NULL)) {
+	lamp_params.target_loops = true;
+	target_loops.clear();
+	if (getenv("LAMP_PROFILE_TARGET_LOOPS") != NULL) {
+	    parse_target_loops(getenv("LAMP_PROFILE_TARGET_LOOPS"));
+	}
+	if (getenv("LAMP_PROFILE_TARGET_LOOPS_FILE") != NULL) {
+	    read_target_loops(getenv("LAMP_PROFILE_TARGET_LOOPS_FILE"));
+	}
+    }
+
+    // The profile is also logged to result.lamp.snapshot on SIGUSR1 (or
+    // LAMP_PROFILE_SNAPSHOT_SIGNAL=<number>, 0 for none) and, with
+    // LAMP_PROFILE_SNAPSHOT_INTERVAL=<seconds>, periodically
+    lamp_params.snapshots = false;
+    lamp_params.snapshot_interval = 0;
+    lamp_params.snapshot_signal = SIGUSR1;
+    if (getenv("LAMP_PROFILE_SNAPSHOT_SIGNAL") != NULL) {
+	lamp_params.snapshot_signal = atoi(getenv("LAMP_PROFILE_SNAPSHOT_SIGNAL"));
     }
-
-    lamp_params.measure_iterations = false;
-    if (((flags & 0x2) != 0) || (getenv("LAMP_PROFILE_MEASURE_ITERATIONS") != NULL)) {
-        lamp_params.measure_iterations = true;
+    if (((flags & 0x400) != 0) || (getenv("LAMP_PROFILE_SNAPSHOTS") != NULL)
+	|| (getenv("LAMP_PROFILE_SNAPSHOT_INTERVAL") != NULL)) {
+	const char *interval = getenv("LAMP_PROFILE_SNAPSHOT_INTERVAL");
+	lamp_params.snapshots = true;
+	if ((interval != NULL) && (atoll(interval) > 0)) {
+	    lamp_params.snapshot_interval = atoll(interval);
+	}
     }
 
-    lamp_params.profile_flow = true;
+    // Counters are published in /dev/shm/lamp-stats.<pid> for lamp-top, and
+    // hook calls are timed
+    lamp_params.live_stats = false;
+    if (((flags & 0x800) != 0) || (getenv("LAMP_PROFILE_LIVE_STATS") != NULL)) {
+	lamp_params.live_stats = true;
+    }
 
-    lamp_params.profile_output = false;
-    if (((flags & 0x4) != 0) || (getenv("LAMP_PROFILE_PROFILE_OUTPUT") != NULL)) {
-        lamp_params.profile_output = true;
-        lamp_params.profile_flow = false;
+    // the values of loads and stores per innermost loop go to result.lamp.values
+    lamp_params.profile_values = false;
+    if (((flags & 0x1000) != 0) || (getenv("LAMP_PROFILE_VALUES") != NULL)) {
+	lamp_params.profile_values = true;
     }
 
     lamp_stats.start_time = clock();
@@ -195,27 +1310,35 @@ void LAMP_init(uint32_t num_instrs, uint32_t num_loops, uint64_t mem_gran, uint6
     lamp_stats.dyn_loads= 0;
     lamp_stats.nest_depth = 0;
     lamp_stats.num_sync_arcs = 0;
+    lamp_stats.rebases = 0;
  
-    external_call_id = 0;
+    lamp_num_instrs = num_instrs;
 
-    memoryProfiler = new MemoryProfilerType(num_instrs);
+    if (lamp_params.live_stats) {
+	start_live_stats();
+    }
 
-    // timestamp 0 is the special first "iteration" of main
-    loop_hierarchy.loopIteration(0);
+    time_stamp = 1;
+    main_thread.initialize(num_instrs, time_stamp, (lamp_params.analysis_threads > 0), lamp_params.profile_values);
+    initialize_sampling(main_thread);
+    thread_state = &main_thread;
+    threads.push_back(&main_thread);
+    attach_stats(main_thread);
+
+    if (lamp_params.snapshots) {
+	start_snapshots();
+    }
 
-    LoopInfoType &loopInfo = loop_hierarchy.getCurrentLoop();
-    DependenceSets dependenceSets(MemoryProfilerType::MAX_TRACKED_DISTANCE);
-    loopInfo.setItem(dependenceSets);
+    start_analysis_threads(lamp_params.analysis_threads);
 
-    time_stamp = 1;
+		LAMP_initialized = 1;
 
-    pageCache = PageCache(num_instrs);
-    Pages pages(memory_stamp);
-    for (uint32_t i = 0; i < num_instrs; i++) {
-	pageCache[i] = pages;
+    // LAMP_PROFILE_GENERIC_HOOKS keeps the hooks that test the flags on each call
+    if ((getenv("LAMP_PROFILE_GENERIC_HOOKS") == NULL) && !hooks_need_generic()) {
+	hooks = HookSelector<HOOKS_GENERIC>::select(hooks_config());
     }
 
-		LAMP_initialized = 1;
+    start_inline_hooks();
 
     atexit(LAMP_finish);
 }
@@ -224,123 +1347,442 @@ void LAMP_init_st() {
     LAMP_init(LAMP_param1, LAMP_param2, LAMP_param3, LAMP_param4);
 }
 
+uint64_t LAMP_shadow_bytes(void) {
+    return memory_stamp.numPages() * SlabArena<StampPage>::OBJECT_SIZE;
+}
+
+class BinaryProfileCollector {
+private:
+    BinaryProfileWriter &writer;
+
+public:
+    BinaryProfileCollector(BinaryProfileWriter &writer) : writer(writer) {}
+
+    void operator()(uint32_t load, uint32_t dist, uint32_t loop, uint32_t store, const MemoryProfile &profile) {
+	profile_record_t record;
+	record.load = load;
+	record.store = store;
+	record.loop = loop;
+	record.dist = dist;
+	record.total_count = profile.getTotalCount();
+	record.loop_count = profile.getLoopCount();
+	writer.add(record);
+    }
+};
+
+/**
+ * Scales the traced dependence counts of a sampled run by the fraction of
+ * each load's executions that were traced.  The bounds are the 95% Wilson
+ * score interval of the per-execution dependence rate, scaled the same way.
+ */
+class SampledDependenceWriter {
+private:
+    ostream &stream;
+
+    const vector<uint64_t> &executed_loads;
+
+    const vector<uint64_t> &traced_loads;
+
+public:
+    SampledDependenceWriter(ostream &stream, const vector<uint64_t> &executed_loads, const vector<uint64_t> &traced_loads)
+	: stream(stream), executed_loads(executed_loads), traced_loads(traced_loads) {}
+
+    void operator()(uint32_t load, uint32_t dist, uint32_t loop, uint32_t store, const MemoryProfile &profile) {
+	static const double z = 1.96;
+
+	const double executed = (load < executed_loads.size()) ? executed_loads[load] : 0;
+	const double traced = (load < traced_loads.size()) ? traced_loads[load] : 0;
+	if (traced == 0)
+	    return;
+
+	const double p = min(1.0, profile.getTotalCount() / traced);
+	const double denominator = 1 + z * z / traced;
+	const double center = (p + z * z / (2 * traced)) / denominator;
+	const double spread = z * sqrt(p * (1 - p) / traced + z * z / (4 * traced * traced)) / denominator;
+
+	stream<<"("<<load<<" "<<dist<<" "<<loop<<" "<<store<<" ("
+	      <<(uint64_t) (profile.getTotalCount() * executed / traced + 0.5)<<" "
+	      <<(uint64_t) (max(0.0, center - spread) * executed)<<" "
+	      <<(uint64_t) ceil(min(1.0, center + spread) * executed)<<" ) )"<<'\n';
+    }
+};
+
+static void write_sampling_profile(ostream &stream, const MemoryProfilerType &memoryProfiler) {
+    vector<uint64_t> &executed_loads = main_thread.executed_loads;
+    vector<uint64_t> &traced_loads = main_thread.traced_loads;
+
+    stream<<"BEGIN Sampled Loads"<<endl;
+    for (uint32_t load = 0; load < executed_loads.size(); load++) {
+	if (executed_loads[load] != 0) {
+	    stream<<"("<<load<<" "<<executed_loads[load]<<" "<<traced_loads[load]<<" )"<<'\n';
+	}
+    }
+    stream<<"END Sampled Loads"<<endl;
+
+    stream<<"BEGIN Sampled Dependences"<<endl;
+    SampledDependenceWriter writer(stream, executed_loads, traced_loads);
+    memoryProfiler.forEach(writer);
+    stream<<"END Sampled Dependences"<<endl;
+}
+
+static void write_binary_profile(const MemoryProfilerType &memoryProfiler) {
+    static const char *filename = "result.lamp.profile.bin";
+
+    BinaryProfileWriter writer(lamp_num_instrs, lamp_params.compress_output);
+    BinaryProfileCollector collector(writer);
+    memoryProfiler.forEach(collector);
+
+    if (!writer.write(filename)) {
+	fprintf(stderr, "Unable to write %s\n", filename);
+    }
+}
+
+static void write_value_profile() {
+    ValueProfilerType *valueProfiler = main_thread.valueProfiler;
+    valueProfiler->flush();
+    for (uint32_t i = 1; i < threads.size(); i++) {
+	threads[i]->valueProfiler->flush();
+	valueProfiler->merge(*(threads[i]->valueProfiler));
+    }
+
+    ofstream stream("result.lamp.values");
+    stream<<*valueProfiler;
+}
+
 void LAMP_finish() {
-    *(lamp_params.lamp_out)<<*memoryProfiler;
+    stop_analysis_threads();
+
+    threads_lock.lock();
+    if (lamp_params.snapshots) {
+	for (uint32_t i = 0; i < threads.size(); i++) {
+	    take_snapshot(*(threads[i]), true);
+	}
+    }
+
+    MemoryProfilerType *memoryProfiler = main_thread.memoryProfiler;
+    for (uint32_t i = 1; i < threads.size(); i++) {
+	memoryProfiler->merge(*(threads[i]->memoryProfiler));
+
+	for (uint32_t j = 0; j < threads[i]->executed_loads.size(); j++) {
+	    main_thread.executed_loads[j] += threads[i]->executed_loads[j];
+	    main_thread.traced_loads[j] += threads[i]->traced_loads[j];
+	}
+    }
+
+    // The binary profile replaces the text dump; the stats stay in the text file
+    if (lamp_params.binary_output) {
+	write_binary_profile(*memoryProfiler);
+    } else {
+	*(lamp_params.lamp_out)<<*memoryProfiler;
+    }
+    if (lamp_params.sampling) {
+	write_sampling_profile(*(lamp_params.lamp_out), *memoryProfiler);
+    }
+    if (lamp_params.profile_values) {
+	write_value_profile();
+    }
     LAMP_print_stats(*(lamp_params.lamp_out));
+    if (stats_segment != NULL) {
+	finish_live_stats();
+    }
+    threads_lock.unlock();
 }
 
-static LoopInfoType &fillInDependence(const timestamp_t value, Dependence &dep) {
+/**
+ * Store stamps come from the global clock, so a stamp written by another
+ * thread is attributed to the innermost loop of this thread that was
+ * already running when the store happened, at the number of this thread's
+ * iterations since then.
+ */
+static LoopInfoType &fillInDependence(ThreadState &thread, const timestamp_t value, Dependence &dep) {
     const uint64_t store_time_stamp = value.timestamp;
     dep.store = value.instr;
-    LoopInfoType &loop = loop_hierarchy.findLoop(store_time_stamp);
+    LoopInfoType &loop = thread.loop_hierarchy.findLoop(store_time_stamp);
     dep.loop = loop.loop_id;
-    dep.dist = loop_hierarchy.calculateDistance(loop, store_time_stamp);
+    dep.dist = thread.loop_hierarchy.calculateDistance(loop, store_time_stamp);
 
     return loop;
 }
 
-template <class T>
-static void memory_profile(const uint32_t destId, const uint64_t addr) {
-    Pages &pages = pageCache.at(destId);
-    const timestamp_t *last_store = NULL;
+template <uint32_t C>
+static void record_dependence(ThreadState &thread, const uint32_t destId, const timestamp_t &store_value,
+			      const uint64_t count = 1) {
+    if (hooks_generic<C>() && (store_value.timestamp < thread.trace_start))
+	return;
 
-    //debug()<<"ML "<<destId<<" "<<(void *) addr<<" "<<sizeof(T)<<" :: ";
-    // cerr<<"ML "<<destId<<" "<<(void *) addr<<" "<<sizeof(T)<<" :: ";
+    Dependence dep(destId);
+    LoopInfoType &loopInfo = fillInDependence(thread, store_value, dep); // fill dep data and get the loop 
 
-    uint8_t i = 0;
-    do {
-	const timestamp_t *store_value = pages.getStampPage()->getItem((void *) (addr + i));
-	if (store_value == NULL) {
-			//debug()<<"U ";
-	    continue;
-	}
+    dep.dist = MemoryProfilerType::trackedDistance(dep.dist); // limit the max to be 1: only care if cross-iter or not
+    MemoryProfile &profile = thread.memoryProfiler->increment(dep, count);
+    thread.stats->counters[DEPENDENCES] += count;
 
-	if ((last_store != NULL) && (*store_value == *last_store)) {
-	    //debug()<<"E ";
-	    continue;
-	}
-	
-	//debug()<<"N ";
+    if (hooks_generic<C>() && lamp_params.snapshots && !profile.isDirty()) {
+	profile.setDirty(true);
+	thread.snapshot_changes.push_back(dep);
+    }
+
+    if (hooks_iterations<C>()) {
+	profile.incrementLoop(loopInfo.getItem());
+    }
+}
+
+/**
+ * addr's page through the shadow TLB; without create, NULL if addr has
+ * never been written.
+ */
+static StampPage *lookup_page(ThreadState &thread, const void *addr, const bool create) {
+    StampPage *page = memory_stamp.getCachedNode(addr);
+    if (page != NULL) {
+	thread.stats->counters[SHADOW_TLB_HITS]++;
+	return page;
+    }
 
-	last_store = store_value;
+    thread.stats->counters[SHADOW_LOOKUPS]++;
+    page = create ? memory_stamp.get_or_create_node(addr) : memory_stamp.getNode(addr);
+    if (page != NULL) {
+	memory_stamp.setCachedNode(addr, page);
+    }
+    return page;
+}
 
-	Dependence dep(destId);
-	LoopInfoType &loopInfo = fillInDependence(*store_value, dep); // fill dep data and get the loop 
+/**
+ * Records the dependence of a load on each store that last wrote one of
+ * its bytes.
+ */
+template <uint32_t C>
+class LoadDependenceRecorder {
+private:
+    ThreadState &thread;
 
-	dep.dist = MemoryProfilerType::trackedDistance(dep.dist); // limit the max to be 1: only care if cross-iter or not
-	MemoryProfile &profile = memoryProfiler->increment(dep);
+    const uint32_t destId;
 
-	if (lamp_params.measure_iterations) {
-	    DependenceSets &dependenceSets = loopInfo.getItem();
-	    pair<DependenceSet::iterator, bool> result = dependenceSets[dep.dist].insert(dep);
-	    if (result.second) {
-		profile.incrementLoop();
-	    }
-	}
-    } while ((++i) < sizeof(T));
+public:
+    LoadDependenceRecorder(ThreadState &thread, const uint32_t destId) : thread(thread), destId(destId) {}
 
-    //debug()<<endl;
+    void operator()(const timestamp_t &store_value) {
+	record_dependence<C>(thread, destId, store_value);
+    }
+};
+
+template <class T, uint32_t C>
+static void memory_profile(ThreadState &thread, const uint32_t destId, const uint64_t addr) {
+    Pages &pages = thread.pageCache.at(destId);
+
+    // a word or half word written by one store is a single stamp
+    LoadDependenceRecorder<C> recorder(thread, destId);
+    StampPage *page = pages.getStampPage();
+    memory_stamp.lockPage(page);
+    page->template forEachAlignedItem<T>((void *) addr, recorder);
+    memory_stamp.unlockPage(page);
 }
 
-template <class T>
-static void LAMP_aligned_load(const uint32_t instr, const uint64_t addr) {
-    if (!LAMP_initialized) return;
+template <class T, uint32_t C>
+static void LAMP_aligned_load(ThreadState &thread, const uint32_t instr, const uint64_t addr) {
+    if (!hooks_initialized<C>()) return;
 	  
-    Pages &pages = pageCache.at(instr);
+    Pages &pages = thread.pageCache.at(instr);
 
-    if (!pages.getStampPage()->inPage((void *) addr)) {
-	pages.setStampPage(memory_stamp.get_or_create_node((void *) addr));
+    if (pages.findStampPage((void *) addr)) {
+	thread.stats->counters[PAGE_CACHE_HITS]++;
+    } else {
+	thread.stats->counters[PAGE_CACHE_MISSES]++;
+	pages.setStampPage(lookup_page(thread, (void *) addr, true));
     }
 
-    if (lamp_params.profile_flow) {
-        memory_profile<T>(instr, addr);
+    if (hooks_flow<C>()) {
+	memory_profile<T, C>(thread, instr, addr);
     }
 }
 
-template <class T>
-static void LAMP_unaligned_load(const uint32_t instr, const uint64_t addr) {
+template <class T, uint32_t C>
+static void LAMP_unaligned_load(ThreadState &thread, const uint32_t instr, const uint64_t addr) {
     for (uint8_t i = 0; i < sizeof(T); i++) {
-	LAMP_aligned_load<uint8_t>(instr, addr + i);
+	LAMP_aligned_load<uint8_t, C>(thread, instr, addr + i);
     }
 }
 
-template <class T>
-void LAMP_load(const uint32_t instr, const uint64_t addr) {
-    lamp_stats.dyn_loads++;
+static void buffer_event(ThreadState &thread, const uint16_t kind, const uint32_t instr,
+			 const uint64_t addr, const uint16_t size) {
+    lamp_event_t event;
+    event.addr = addr;
+    event.instr = instr;
+    event.size = size;
+    event.kind = kind;
 
+    while (!thread.events->push(event)) {
+	sched_yield();
+    }
+}
+
+static void buffer_range(ThreadState &thread, const uint16_t kind, const uint32_t instr,
+			 const void *memory, const uint64_t size) {
+    const uint64_t cptr = (uint64_t) (intptr_t) memory;
+    for (uint64_t i = 0; i < size; i += EVENT_SIZE_MAX) {
+	const uint64_t chunk = ((size - i) < EVENT_SIZE_MAX) ? (size - i) : EVENT_SIZE_MAX;
+	buffer_event(thread, kind, instr, cptr + i, chunk);
+    }
+}
+
+template <class T, uint32_t C>
+static void profile_load(ThreadState &thread, const uint32_t instr, const uint64_t addr) {
     if (!Memory::is_aligned<T>(addr)) {
-	LAMP_unaligned_load<T>(instr, addr);
+	thread.stats->counters[UNALIGNED_SPLITS]++;
+	LAMP_unaligned_load<T, C>(thread, instr, addr);
     } else {
-	LAMP_aligned_load<T>(instr, addr);
+	LAMP_aligned_load<T, C>(thread, instr, addr);
+    }
+}
+
+/**
+ * Counting-only fast path of the sampling runtime: returns whether the
+ * load is traced.
+ */
+static inline bool sample_load(ThreadState &thread, const uint32_t instr, const uint64_t count) {
+    thread.executed_loads[instr] += count;
+    if (thread.sample_phase != SAMPLE_TRACE)
+	return false;
+
+    thread.traced_loads[instr] += count;
+    return true;
+}
+
+static inline bool sample_store(ThreadState &thread) {
+    return thread.sample_phase != SAMPLE_SKIP;
+}
+
+static inline bool in_target_loop(const ThreadState &thread) {
+    return !lamp_params.target_loops || (thread.target_depth != 0);
+}
+
+/**
+ * Profiles the value at the time of the hook, before it is buffered.
+ */
+static inline void profile_value(ThreadState &thread, const uint32_t instr, const uint64_t value) {
+    thread.valueProfiler->increment(instr, thread.value_loops.back(), thread.value_invocations.back(), value);
+}
+
+template <class T>
+static inline uint64_t load_value(const uint64_t addr) {
+    T value;
+    memcpy(&value, (const void *) addr, sizeof(T));
+    return value;
+}
+
+template <class T, uint32_t C>
+void LAMP_load(const uint32_t instr, const uint64_t addr) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_LOAD, hooks_generic<C>() && lamp_params.live_stats);
+    thread.dyn_loads++;
+
+    if (hooks_generic<C>() && !in_target_loop(thread))
+	return;
+
+    if (hooks_generic<C>() && lamp_params.profile_values) {
+	profile_value(thread, instr, load_value<T>(addr));
     }
+
+    if (hooks_generic<C>() && lamp_params.sampling && !sample_load(thread, instr, 1))
+	return;
+
+    if (hooks_generic<C>() && (thread.events != NULL)) {
+	buffer_event(thread, EVENT_LOAD, instr, addr, sizeof(T));
+	return;
+    }
+
+    profile_load<T, C>(thread, instr, addr);
 }
 
 void LAMP_load1(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint8_t>(instr, addr);
+    hooks.load1(instr, addr);
 }
 
 void LAMP_load2(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint16_t>(instr, addr);
+    hooks.load2(instr, addr);
 }
 
 void LAMP_load4(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint32_t>(instr, addr);
+    hooks.load4(instr, addr);
 }
 
 void LAMP_load8(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint64_t>(instr, addr);
+    hooks.load8(instr, addr);
 }
 
 
-void LAMP_external_load(const void * src, const uint64_t size) {
+/**
+ * Records, for every valid byte of a range, the dependence on the store
+ * that last wrote it, the same as one byte-sized load per byte would.
+ */
+class RangeDependenceRecorder {
+private:
+    ThreadState &thread;
+
+    const uint32_t instr;
+
+public:
+    RangeDependenceRecorder(ThreadState &thread, const uint32_t instr) : thread(thread), instr(instr) {}
+
+    void operator()(const timestamp_t &store_value, const uint32_t count) {
+	record_dependence<HOOKS_GENERIC>(thread, instr, store_value, count);
+    }
+};
+
+void LAMP_inline_dependence(const uint32_t instr, const uint64_t stamp) {
+    timestamp_t store_value;
+    memcpy(&store_value, &stamp, sizeof(store_value));
+    record_dependence<HOOKS_GENERIC>(main_thread, instr, store_value);
+}
+
+static void external_load(ThreadState &thread, const uint32_t external_call_id, const void * src, const uint64_t size) {
+    if (!LAMP_initialized || !lamp_params.profile_flow)
+	return;
+
+    // MJB: It is important that src not be dereferenced, as it may not longer be valid
+    // (ex. if realloc freed the src pointer)
+    thread.stats->counters[EXTERNAL_LOAD_BYTES] += size;
+
+    RangeDependenceRecorder recorder(thread, external_call_id);
     const uint64_t cptr = (uint64_t) (intptr_t) src;
-    for (uint64_t i = 0; i < size; i++) {
-	const uint64_t addr = cptr + i;
-	// MJB: It is important that src not be dereferenced, as it may not longer be valid
-	// (ex. if realloc freed the src pointer)
-	
-	LAMP_load1(external_call_id, addr);
+    for (uint64_t i = 0; i < size; ) {
+	const uint64_t chunk = page_chunk(cptr + i, size - i);
+	const StampPage *page = lookup_page(thread, (void *) (cptr + i), false);
+	if (page != NULL) {
+	    memory_stamp.lockPage(page);
+	    page->forEachItem((void *) (cptr + i), chunk, recorder);
+	    memory_stamp.unlockPage(page);
+	}
+	i += chunk;
+    }
+}
+
+static void load_range(ThreadState &thread, const uint32_t instr, const void * src, const uint64_t size) {
+    thread.dyn_loads += size;
+
+    if (!in_target_loop(thread))
+	return;
+
+    if (lamp_params.sampling && !sample_load(thread, instr, size))
+	return;
+
+    if (thread.events != NULL) {
+	buffer_range(thread, EVENT_EXTERNAL_LOAD, instr, src, size);
+	return;
     }
+
+    external_load(thread, instr, src, size);
+}
+
+void LAMP_load_range(const uint32_t instr, const void * src, const uint64_t size) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_EXTERNAL);
+    load_range(thread, instr, src, size);
+}
+
+void LAMP_external_load(const void * src, const uint64_t size) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_EXTERNAL);
+    load_range(thread, thread.external_call_id, src, size);
 }
 
 static timestamp_t form_timestamp(uint32_t instr, uint64_t timestamp) {
@@ -360,107 +1802,211 @@ static timestamp_t form_timestamp(uint32_t instr, uint64_t timestamp) {
     return ts;
 }
 
-template<class T>
-static void LAMP_aligned_store(uint32_t instrId, uint64_t addr) {
-    if (!LAMP_initialized) return;
+template<class T, uint32_t C>
+static void LAMP_aligned_store(ThreadState &thread, uint32_t instrId, uint64_t addr) {
+    if (!hooks_initialized<C>()) return;
 
-    Pages &pages = pageCache.at(instrId);
-    if (!pages.getStampPage()->inPage((void *) addr)) {
-	pages.setStampPage(memory_stamp.get_or_create_node((void *) addr));
+    Pages &pages = thread.pageCache.at(instrId);
+    if (pages.findStampPage((void *) addr)) {
+	thread.stats->counters[PAGE_CACHE_HITS]++;
+    } else {
+	thread.stats->counters[PAGE_CACHE_MISSES]++;
+	pages.setStampPage(lookup_page(thread, (void *) addr, true));
     }
 
-    if (lamp_params.profile_output) {
-        memory_profile<T>(instrId, addr);
+    if (hooks_output<C>()) {
+	memory_profile<T, C>(thread, instrId, addr);
     }
 
-    const timestamp_t val = form_timestamp(instrId, time_stamp);
+    const timestamp_t val = form_timestamp(instrId, thread.time_stamp);
     //debug()<<"S "<<instrId<<" "<<(void *) addr<<" "<<sizeof(T)<<" "<<val<<" ";
 
-    for (uint8_t i = 0; i < sizeof(T); i++) {
-	//debug()<<"S ";
-	pages.getStampPage()->setItem((void *) (addr + i), val);
-    }
+    StampPage *page = pages.getStampPage();
+    memory_stamp.lockPage(page);
+    page->template setAlignedItem<T>((void *) addr, val);
+    memory_stamp.unlockPage(page);
 
     //debug()<<endl;
 }
 
-template<class T>
-static void LAMP_unaligned_store(uint32_t instrId, uint64_t addr) {
+template<class T, uint32_t C>
+static void LAMP_unaligned_store(ThreadState &thread, uint32_t instrId, uint64_t addr) {
     for (uint8_t i = 0; i < sizeof(T); i++) {
-	LAMP_aligned_store<uint8_t>(instrId, addr + i);
+	LAMP_aligned_store<uint8_t, C>(thread, instrId, addr + i);
     }
 }
 
-template<class T>
+template<class T, uint32_t C>
 static bool is_silent_store(const uint32_t instr, const uint64_t addr, const uint64_t value) {
-    if (!lamp_params.silent_stores)
+    if (!hooks_silent_stores<C>())
         return false;
 
     return (*((const T *) addr) == ((T) value));
 }
 
-template<class T>
+template<class T, uint32_t C>
+static void profile_store(ThreadState &thread, uint32_t instrID, uint64_t addr) {
+    if (!Memory::is_aligned<T>(addr)) {
+	thread.stats->counters[UNALIGNED_SPLITS]++;
+	LAMP_unaligned_store<T, C>(thread, instrID, addr);
+    } else {
+	LAMP_aligned_store<T, C>(thread, instrID, addr);
+    }
+}
+
+template<class T, uint32_t C>
 void LAMP_store(uint32_t instrID, uint64_t addr, uint64_t value) {
-    lamp_stats.dyn_stores++;
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_STORE, hooks_generic<C>() && lamp_params.live_stats);
+    thread.dyn_stores++;
+
+    if (hooks_generic<C>() && lamp_params.profile_values && in_target_loop(thread)) {
+	profile_value(thread, instrID, (T) value);
+    }
 
-    if (is_silent_store<T>(instrID, addr, value))
+    if (is_silent_store<T, C>(instrID, addr, value))
         return;
 
-    if (!Memory::is_aligned<T>(addr)) {
-	LAMP_unaligned_store<T>(instrID, addr);
-    } else {
-	LAMP_aligned_store<T>(instrID, addr);
+    if (hooks_generic<C>() && lamp_params.sampling && !sample_store(thread))
+	return;
+
+    if (hooks_generic<C>() && (thread.events != NULL)) {
+	buffer_event(thread, EVENT_STORE, instrID, addr, sizeof(T));
+	return;
     }
+
+    profile_store<T, C>(thread, instrID, addr);
 }
 
 void LAMP_store1(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint8_t>(instr, addr, value);
+    hooks.store1(instr, addr, value);
 }
 
 void LAMP_store2(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint16_t>(instr, addr, value);
+    hooks.store2(instr, addr, value);
 }
 
 void LAMP_store4(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint32_t>(instr, addr, value);
+    hooks.store4(instr, addr, value);
 }
 
 void LAMP_store8(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint64_t>(instr, addr, value);
+    hooks.store8(instr, addr, value);
 }
 
-void LAMP_external_store(const void * dest, const uint64_t size) {
+static void external_store(ThreadState &thread, const uint32_t external_call_id, const void * dest, const uint64_t size) {
+    if (!LAMP_initialized)
+	return;
+
+    thread.stats->counters[EXTERNAL_STORE_BYTES] += size;
+
+    const timestamp_t val = form_timestamp(external_call_id, thread.time_stamp);
+    RangeDependenceRecorder recorder(thread, external_call_id);
     const uint64_t cptr = (uint64_t) (intptr_t) dest;
-    for (uint64_t i = 0; i < size; i++) {
-	const uint64_t addr = cptr + i;
+    for (uint64_t i = 0; i < size; ) {
+	const uint64_t chunk = page_chunk(cptr + i, size - i);
+	StampPage *page = lookup_page(thread, (void *) (cptr + i), true);
+
+	memory_stamp.lockPage(page);
+	if (lamp_params.profile_output) {
+	    page->forEachItem((void *) (cptr + i), chunk, recorder);
+	}
+	page->setRange((void *) (cptr + i), chunk, val);
+	memory_stamp.unlockPage(page);
+	i += chunk;
+    }
+}
+
+static void store_range(ThreadState &thread, const uint32_t instr, const void * dest, const uint64_t size) {
+    if (lamp_params.sampling && !sample_store(thread))
+	return;
 
-	LAMP_aligned_store<uint8_t>(external_call_id, addr);
+    if (thread.events != NULL) {
+	buffer_range(thread, EVENT_EXTERNAL_STORE, instr, dest, size);
+	return;
     }
+
+    external_store(thread, instr, dest, size);
+}
+
+void LAMP_store_range(const uint32_t instr, const void * dest, const uint64_t size) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_EXTERNAL);
+    thread.dyn_stores += size;
+    store_range(thread, instr, dest, size);
+}
+
+void LAMP_external_store(const void * dest, const uint64_t size) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_EXTERNAL);
+    store_range(thread, thread.external_call_id, dest, size);
 }
 
 static void invalidate_region(const void *memory, size_t size) {
-    for (uint64_t i = 0; i < size; i++) {
-	memory_stamp.set_invalid<uint8_t>((uint8_t*)memory+i);
+    const uint64_t cptr = (uint64_t) (intptr_t) memory;
+    for (uint64_t i = 0; i < size; ) {
+	const uint64_t chunk = page_chunk(cptr + i, size - i);
+	memory_stamp.set_range_invalid((void *) (cptr + i), chunk);
+	i += chunk;
     }
 }
 
 void LAMP_allocate(uint32_t lampId, const void *memory, size_t size) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_MEMORY);
+    if (thread.events != NULL) {
+	buffer_range(thread, EVENT_ALLOCATE, lampId, memory, size);
+	return;
+    }
+
     invalidate_region(memory, size);
 }
 
+/**
+ * invalidate_region for freed memory, reclaiming the shadow pages it empties.
+ */
+static void release_region(const void *memory, size_t size) {
+    const uint64_t cptr = (uint64_t) (intptr_t) memory;
+    for (uint64_t i = 0; i < size; ) {
+	const uint64_t chunk = page_chunk(cptr + i, size - i);
+	memory_stamp.release_range((void *) (cptr + i), chunk);
+	i += chunk;
+    }
+}
+
+static void deallocate(ThreadState &thread, uint32_t lampId, const void *memory, size_t size) {
+    external_store(thread, lampId, memory, size);
+    release_region(memory, size);
+}
+
 void LAMP_deallocate(uint32_t lampId, const void *memory, size_t size) {
-    for (uint64_t i = 0; i < size; i++) {
-        LAMP_aligned_store<uint8_t>(lampId, ((uint64_t)memory+i));
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_MEMORY);
+
+    // outside a burst the freeing stores are not recorded, only the invalidation
+    if (lamp_params.sampling && !sample_store(thread)) {
+	if (thread.events != NULL) {
+	    buffer_range(thread, EVENT_ALLOCATE, lampId, memory, size);
+	} else {
+	    release_region(memory, size);
+	}
+	return;
     }
-    invalidate_region(memory, size);
+
+    if (thread.events != NULL) {
+	buffer_range(thread, EVENT_DEALLOCATE, lampId, memory, size);
+	return;
+    }
+
+    deallocate(thread, lampId, memory, size);
 }
 
 void LAMP_external_allocate(const void *memory, size_t size) {
-    LAMP_allocate(external_call_id, memory, size);
+    LAMP_allocate(current_thread().external_call_id, memory, size);
 }
 
 void LAMP_external_deallocate(const void *memory, size_t size) {
-    LAMP_deallocate(external_call_id, memory, size);
+    LAMP_deallocate(current_thread().external_call_id, memory, size);
 }
 
 void LAMP_allocate_st(void) {
@@ -468,30 +2014,74 @@ void LAMP_allocate_st(void) {
 }
 
 
-static void initializeSets() {
+/**
+ * Gives the current loop iteration a new epoch, so every dependence is
+ * counted again by incrementLoop; nothing is cleared.
+ */
+static void start_epoch(ThreadState &thread) {
     if (!lamp_params.measure_iterations)
 	return;
 
-    LoopInfoType &loopInfo = loop_hierarchy.getCurrentLoop();
-    DependenceSets &dependenceSets = loopInfo.getItem();
+    thread.loop_hierarchy.getCurrentLoop().setItem(++thread.iteration_epoch);
+}
+
+static void start_burst(ThreadState &thread) {
+    thread.trace_start = thread.time_stamp;
+}
+
+/**
+ * Advances the thread's sampling phase by one loop iteration or invocation.
+ * Runs in the hook, after the tick itself has been applied or buffered, so
+ * the warm-up starts at the tick's time stamp.
+ */
+static void sample_tick(ThreadState &thread) {
+    if (--thread.sample_countdown != 0)
+	return;
 
-    if (dependenceSets.size() != MemoryProfilerType::MAX_TRACKED_DISTANCE) {
-	for (uint32_t i = dependenceSets.size(); i < MemoryProfilerType::MAX_TRACKED_DISTANCE; i++) {
-	    DependenceSet seta;
-	    dependenceSets.push_back(seta);
+    switch (thread.sample_phase) {
+    case SAMPLE_SKIP:
+	thread.sample_phase = SAMPLE_WARMUP;
+	thread.sample_countdown = 1;
+	if (thread.events != NULL) {
+	    buffer_event(thread, EVENT_SAMPLE_BURST, 0, 0, 0);
+	} else {
+	    start_burst(thread);
 	}
+	break;
+    case SAMPLE_WARMUP:
+	thread.sample_phase = SAMPLE_TRACE;
+	thread.sample_countdown = lamp_params.sample_burst;
+	break;
+    default:
+	thread.sample_phase = SAMPLE_SKIP;
+	thread.sample_countdown = lamp_params.sample_period - lamp_params.sample_burst - 1;
+	break;
     }
-    
-    DependenceSets::iterator viter = dependenceSets.begin();
-    for (; viter != dependenceSets.end(); viter++) {
-	viter->clear();
+}
+
+static void loop_iteration(ThreadState &thread, const uint64_t time_stamp) {
+    thread.time_stamp = time_stamp;
+    thread.loop_hierarchy.loopIteration(thread.time_stamp);
+    start_epoch(thread);
+
+    if (lamp_params.snapshots) {
+	poll_snapshot(thread);
     }
 }
 
 void LAMP_loop_iteration_begin(void) {
-    time_stamp++;
-    loop_hierarchy.loopIteration(time_stamp);
-    initializeSets();
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_LOOP);
+    const uint64_t iteration_time_stamp = next_time_stamp();
+    if (thread.events != NULL) {
+	buffer_event(thread, EVENT_LOOP_ITERATION, 0, iteration_time_stamp, 0);
+    } else {
+	loop_iteration(thread, iteration_time_stamp);
+    }
+
+    if (lamp_params.sampling && !lamp_params.sample_invocations) {
+	sample_tick(thread);
+    }
 }
 
 void LAMP_loop_iteration_end(void) {
@@ -507,28 +2097,196 @@ void LAMP_loop_iteration_end_st(void) {
 }
 
 void LAMP_loop_exit(void) {
-    loop_hierarchy.exitLoop();
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_LOOP);
+    if (lamp_params.target_loops) {
+	if (thread.loop_depth == thread.target_depth) {
+	    thread.target_depth = 0;
+	}
+	thread.loop_depth--;
+    }
+
+    if (lamp_params.profile_values && (thread.value_loops.size() > 1)) {
+	thread.value_loops.pop_back();
+	thread.value_invocations.pop_back();
+    }
+
+    if (thread.events != NULL) {
+	buffer_event(thread, EVENT_LOOP_EXIT, 0, 0, 0);
+	return;
+    }
+
+    thread.loop_hierarchy.exitLoop();
 }
 
 void LAMP_loop_exit_st(void) {
     LAMP_loop_exit();
 }
 
-void LAMP_loop_invocation(const uint16_t loop) {
-    loop_hierarchy.enterLoop(loop, time_stamp);
-    initializeSets();
+static void loop_invocation(ThreadState &thread, const uint32_t loop) {
+    thread.loop_hierarchy.enterLoop(loop, thread.time_stamp);
+    start_epoch(thread);
+}
+
+void LAMP_loop_invocation_wide(const uint32_t loop) {
+    ThreadState &thread = current_thread();
+    HookTimer timer(thread, HOOK_LOOP);
+    if (lamp_params.target_loops) {
+	thread.loop_depth++;
+	if ((thread.target_depth == 0) && (loop < target_loops.size()) && target_loops[loop]) {
+	    thread.target_depth = thread.loop_depth;
+	}
+    }
+
+    if (lamp_params.profile_values) {
+	thread.value_loops.push_back(loop);
+	thread.value_invocations.push_back(++thread.num_invocations);
+    }
+
+    if (thread.events != NULL) {
+	buffer_event(thread, EVENT_LOOP_INVOCATION, loop, 0, 0);
+    } else {
+	loop_invocation(thread, loop);
+    }
+
+    if (lamp_params.sampling && lamp_params.sample_invocations) {
+	sample_tick(thread);
+    }
 }
  
+void LAMP_loop_invocation(const uint16_t loop) {
+    LAMP_loop_invocation_wide(loop);
+}
+
 void LAMP_loop_invocation_st(void) {
-    uint16_t loop_id = (uint16_t) LAMP_param1;
-    LAMP_loop_invocation(loop_id);
+    uint32_t loop_id = (uint32_t) LAMP_param1;
+    LAMP_loop_invocation_wide(loop_id);
 }
 
 void LAMP_register(uint32_t id) {
-    external_call_id = id;
+    current_thread().external_call_id = id;
     LAMP_param1 = id;
 }
 
 void LAMP_register_st(void) {
     LAMP_register((uint32_t) LAMP_param1);
 }
+
+/***** asynchronous analysis *****/
+
+static vector<pthread_t> analysis_threads;
+
+static bool analysis_stop = false;
+
+static void apply_event(ThreadState &thread, const lamp_event_t &event) {
+    switch (event.kind) {
+    case EVENT_LOAD:
+	switch (event.size) {
+	case 1: profile_load<uint8_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	case 2: profile_load<uint16_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	case 4: profile_load<uint32_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	case 8: profile_load<uint64_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	default: abort();
+	}
+	break;
+    case EVENT_STORE:
+	switch (event.size) {
+	case 1: profile_store<uint8_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	case 2: profile_store<uint16_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	case 4: profile_store<uint32_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	case 8: profile_store<uint64_t, HOOKS_GENERIC>(thread, event.instr, event.addr); break;
+	default: abort();
+	}
+	break;
+    case EVENT_EXTERNAL_LOAD:
+	external_load(thread, event.instr, (void *) event.addr, event.size);
+	break;
+    case EVENT_EXTERNAL_STORE:
+	external_store(thread, event.instr, (void *) event.addr, event.size);
+	break;
+    case EVENT_ALLOCATE:
+	invalidate_region((void *) event.addr, event.size);
+	break;
+    case EVENT_DEALLOCATE:
+	deallocate(thread, event.instr, (void *) event.addr, event.size);
+	break;
+    case EVENT_LOOP_INVOCATION:
+	loop_invocation(thread, event.instr);
+	break;
+    case EVENT_LOOP_ITERATION:
+	loop_iteration(thread, event.addr);
+	break;
+    case EVENT_LOOP_EXIT:
+	thread.loop_hierarchy.exitLoop();
+	break;
+    case EVENT_SAMPLE_BURST:
+	start_burst(thread);
+	break;
+    default:
+	fprintf(stderr, "Unknown LAMP event %u\n", event.kind);
+	abort();
+    }
+}
+
+/**
+ * Each program thread's buffer is drained by exactly one analysis thread
+ * (threads[i] belongs to analysis thread i % n), so its events are applied
+ * in program order.  Events of different threads are not: a store can be
+ * applied after another thread's later load of the same bytes, or after a
+ * later store to them.  Dependences between threads are approximate in
+ * this mode, so a lost or reversed one is possible; dependences within a
+ * thread are exact.
+ */
+static void *analysis_thread(void *arg) {
+    const uint32_t id = (uint32_t) (intptr_t) arg;
+    const uint32_t num_threads = lamp_params.analysis_threads;
+    static const uint32_t BATCH_SIZE = 4096;
+
+    while (true) {
+	// read before the pass: once it is set, every event was pushed before
+	// the pass started, so an idle pass has drained them all
+	const bool stopping = __atomic_load_n(&analysis_stop, __ATOMIC_ACQUIRE);
+	bool idle = true;
+
+	for (uint32_t i = id; ; i += num_threads) {
+	    threads_lock.lock();
+	    ThreadState *state = (i < threads.size()) ? threads[i] : NULL;
+	    threads_lock.unlock();
+	    if (state == NULL)
+		break;
+
+	    lamp_event_t event;
+	    for (uint32_t n = 0; (n < BATCH_SIZE) && state->events->pop(event); n++) {
+		apply_event(*state, event);
+		idle = false;
+	    }
+	}
+
+	if (idle) {
+	    if (stopping)
+		break;
+	    usleep(50);
+	}
+    }
+
+    return NULL;
+}
+
+static void start_analysis_threads(uint32_t num_threads) {
+    for (uint32_t i = 0; i < num_threads; i++) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, analysis_thread, (void *) (intptr_t) i) != 0) {
+	    fprintf(stderr, "Unable to create LAMP analysis thread\n");
+	    abort();
+	}
+	analysis_threads.push_back(thread);
+    }
+}
+
+static void stop_analysis_threads() {
+    __atomic_store_n(&analysis_stop, true, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < analysis_threads.size(); i++) {
+	pthread_join(analysis_threads[i], NULL);
+    }
+    analysis_threads.clear();
+}
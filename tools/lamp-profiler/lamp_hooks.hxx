@@ -54,14 +54,21 @@ void LAMP_register(uint32_t lampId);
 void LAMP_loop_iteration_begin(void);
 void LAMP_loop_iteration_end(void);
 void LAMP_loop_invocation(uint16_t loopId);
+void LAMP_loop_invocation_wide(uint32_t loopId);
 void LAMP_loop_exit(void);
 
 void LAMP_external_load(const void * addr, const uint64_t size);
 void LAMP_external_store(const void * addr, const uint64_t size);
 
+void LAMP_load_range(const uint32_t instr, const void * addr, const uint64_t size);
+void LAMP_store_range(const uint32_t instr, const void * addr, const uint64_t size);
+
 void LAMP_external_allocate(const void *memory, size_t size);
 void LAMP_external_deallocate(const void *memory, size_t size);
 
+/* bytes of shadow memory currently held for the program's data */
+uint64_t LAMP_shadow_bytes(void);
+
 
 #ifdef __cplusplus
 }
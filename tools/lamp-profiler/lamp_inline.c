@@ -0,0 +1,7 @@
+/*
+ * The inline hooks of lamp_inline.h with external linkage, compiled to
+ * lamp_inline.bc for the instrumentation pass to link and inline.
+ */
+#define LAMP_INLINE
+
+#include "lamp_inline.h"
@@ -0,0 +1,165 @@
+#ifndef LAMP_INLINE_H
+#define LAMP_INLINE_H
+
+#include "lamp_hooks.hxx"
+
+/*
+ * Inlinable fast path of the 4 and 8 byte load and store hooks, for the
+ * instrumentation to call instead of LAMP_loadN and LAMP_storeN.  An
+ * aligned access to the most recent page of its instruction's page cache
+ * is handled here: a store writes its shadow stamp, a load of bytes never
+ * written returns, and a load of a single stamp only calls out to record
+ * the dependence.  Everything else goes to the out-of-line hook, which
+ * also refills the page cache.
+ *
+ * LAMP_init only enables the fast path for the synchronous single-threaded
+ * runtime profiling flow dependences, without sampling, target loops,
+ * value profiling, silent stores or live stats.
+ *
+ * lamp_inline.c compiles these functions with external linkage into
+ * lamp_inline.bc, for the instrumentation pass to link and inline.
+ */
+
+#ifndef LAMP_INLINE
+#define LAMP_INLINE static inline
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LAMP_SHADOW_PAGE_SIZE 4096
+
+#define LAMP_PAGE_CACHE_WAYS 4
+
+/* the runtime's shadow page, WordPage<timestamp_t>; LAMP_init checks it */
+typedef struct lamp_shadow_page_s {
+    uint64_t page_addr;
+    uint64_t stamps[LAMP_SHADOW_PAGE_SIZE];    /* (time stamp << 24) | instr */
+    uint64_t valid[LAMP_SHADOW_PAGE_SIZE / 64];
+    uint64_t invalid[LAMP_SHADOW_PAGE_SIZE / 64];
+    uint64_t word_uniform[LAMP_SHADOW_PAGE_SIZE / 256];    /* the word's stamp is in its first slot */
+    uint64_t half_uniform[LAMP_SHADOW_PAGE_SIZE / 256];    /* the half word's stamp is in its first slot */
+} lamp_shadow_page_t;
+
+extern int LAMP_inline_enabled;
+
+/* LAMP_PAGE_CACHE_WAYS pages per instruction, the most recent first */
+extern lamp_shadow_page_t **LAMP_inline_pages;
+
+extern uint64_t *LAMP_inline_time_stamp;
+
+extern uint64_t LAMP_inline_loads;
+extern uint64_t LAMP_inline_stores;
+
+void LAMP_inline_dependence(const uint32_t instr, const uint64_t stamp);
+
+#define LAMP_INLINE_BIT(bits, i) (((bits)[(i) >> 6] >> ((i) & 63)) & 1)
+
+LAMP_INLINE lamp_shadow_page_t *LAMP_inline_page(const uint32_t instr, const uint64_t addr) {
+    lamp_shadow_page_t *page = LAMP_inline_pages[instr * LAMP_PAGE_CACHE_WAYS];
+    return (page->page_addr == (addr & ~((uint64_t) LAMP_SHADOW_PAGE_SIZE - 1))) ? page : NULL;
+}
+
+/* 0 if no byte was written, 1 if all bytes share *stamp, -1 otherwise */
+LAMP_INLINE int LAMP_inline_stamp(const lamp_shadow_page_t *page, const uint32_t offset, const uint32_t size,
+				  uint64_t *stamp) {
+    const uint64_t mask = (1ULL << size) - 1;
+    const uint64_t valid = (page->valid[offset >> 6] >> (offset & 63)) & mask;
+    if (valid == 0)
+	return 0;
+    if (valid != mask)
+	return -1;
+
+    if (LAMP_INLINE_BIT(page->word_uniform, offset >> 3)) {
+	*stamp = page->stamps[offset & ~7];
+	return 1;
+    }
+    if ((size == 4) && LAMP_INLINE_BIT(page->half_uniform, offset >> 2)) {
+	*stamp = page->stamps[offset];
+	return 1;
+    }
+    return -1;
+}
+
+/* whether the load was handled inline */
+LAMP_INLINE int LAMP_inline_load(const uint32_t instr, const uint64_t addr, const uint32_t size) {
+    if (!LAMP_inline_enabled || ((addr & (size - 1)) != 0))
+	return 0;
+
+    const lamp_shadow_page_t *page = LAMP_inline_page(instr, addr);
+    if (page == NULL)
+	return 0;
+
+    uint64_t stamp = 0;
+    const int stamps = LAMP_inline_stamp(page, addr & (LAMP_SHADOW_PAGE_SIZE - 1), size, &stamp);
+    if (stamps < 0)
+	return 0;
+
+    LAMP_inline_loads++;
+    if (stamps > 0) {
+	LAMP_inline_dependence(instr, stamp);
+    }
+    return 1;
+}
+
+LAMP_INLINE void LAMP_inline_load4(const uint32_t instr, const uint64_t addr) {
+    if (!LAMP_inline_load(instr, addr, 4)) {
+	LAMP_load4(instr, addr);
+    }
+}
+
+LAMP_INLINE void LAMP_inline_load8(const uint32_t instr, const uint64_t addr) {
+    if (!LAMP_inline_load(instr, addr, 8)) {
+	LAMP_load8(instr, addr);
+    }
+}
+
+LAMP_INLINE void LAMP_inline_store4(const uint32_t instr, const uint64_t addr, const uint64_t value) {
+    lamp_shadow_page_t *page;
+    if (!LAMP_inline_enabled || ((addr & 3) != 0) || ((page = LAMP_inline_page(instr, addr)) == NULL)) {
+	LAMP_store4(instr, addr, value);
+	return;
+    }
+
+    const uint32_t offset = addr & (LAMP_SHADOW_PAGE_SIZE - 1);
+    const uint32_t word = offset >> 3, half = offset >> 2;
+
+    /* the other half keeps the word's stamp */
+    if (LAMP_INLINE_BIT(page->word_uniform, word)) {
+	const uint32_t base = offset & ~7;
+	page->stamps[base + 4] = page->stamps[base];
+	page->word_uniform[word >> 6] &= ~(1ULL << (word & 63));
+	page->half_uniform[half >> 6] |= (3ULL << ((half & ~1) & 63));
+    }
+
+    page->stamps[offset] = (*LAMP_inline_time_stamp << 24) | instr;
+    page->half_uniform[half >> 6] |= (1ULL << (half & 63));
+    page->valid[offset >> 6] |= (0xfULL << (offset & 63));
+    page->invalid[offset >> 6] &= ~(0xfULL << (offset & 63));
+    LAMP_inline_stores++;
+}
+
+LAMP_INLINE void LAMP_inline_store8(const uint32_t instr, const uint64_t addr, const uint64_t value) {
+    lamp_shadow_page_t *page;
+    if (!LAMP_inline_enabled || ((addr & 7) != 0) || ((page = LAMP_inline_page(instr, addr)) == NULL)) {
+	LAMP_store8(instr, addr, value);
+	return;
+    }
+
+    const uint32_t offset = addr & (LAMP_SHADOW_PAGE_SIZE - 1);
+    const uint32_t word = offset >> 3, half = offset >> 2;
+
+    page->stamps[offset] = (*LAMP_inline_time_stamp << 24) | instr;
+    page->word_uniform[word >> 6] |= (1ULL << (word & 63));
+    page->half_uniform[half >> 6] &= ~(3ULL << (half & 63));
+    page->valid[offset >> 6] |= (0xffULL << (offset & 63));
+    page->invalid[offset >> 6] &= ~(0xffULL << (offset & 63));
+    LAMP_inline_stores++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LAMP_INLINE_H */
@@ -0,0 +1,177 @@
+#include "../utils/RuntimeStats.hxx"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+
+#include <vector>
+
+using namespace std;
+using namespace Stats;
+
+/**
+ * lamp-top: watches the live counters of a running LAMP profile.
+ *
+ *   lamp-top [-d seconds] [-n updates] [pid]
+ *
+ * The runtime publishes them when started with LAMP_PROFILE_LIVE_STATS.
+ * Without a pid, the only LAMP run still alive is watched.  Rates are per
+ * second of wall time since the previous update; hook time is in percent
+ * of one core.
+ */
+
+static bool is_running(const uint64_t pid) {
+    return (kill((pid_t) pid, 0) == 0) || (errno == EPERM);
+}
+
+/**
+ * Pids of the live runs that have a stats segment.
+ */
+static void find_runs(vector<uint64_t> &pids) {
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL)
+	return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+	unsigned long pid;
+	if ((sscanf(entry->d_name, "lamp-stats.%lu", &pid) == 1) && is_running(pid)) {
+	    pids.push_back(pid);
+	}
+    }
+    closedir(dir);
+}
+
+typedef struct sample_s {
+    uint64_t ns;
+    stats_slot_t total;
+} sample_t;
+
+static void take_sample(const stats_segment_t *segment, sample_t &sample) {
+    sample.ns = read_ns();
+    sum_slots(segment, sample.total);
+}
+
+static double cycles_per_second(const stats_segment_t *segment) {
+    const uint64_t ns = segment->heartbeat_ns - segment->start_ns;
+    if (ns == 0)
+	return 0;
+    return (segment->heartbeat_cycles - segment->start_cycles) * 1e9 / ns;
+}
+
+static void print_sample(const stats_segment_t *segment, const sample_t &last, const sample_t &now,
+			 const bool running) {
+    const double seconds = (now.ns - last.ns) * 1e-9;
+    const double elapsed = (now.ns - segment->start_ns) * 1e-9;
+
+    printf("LAMP pid %lu, %u threads, %.1f s, %s\n\n", (unsigned long) segment->pid, segment->num_threads, elapsed,
+	   segment->finished ? "finished" : (running ? "running" : "exited"));
+
+    printf("%-24s %16s %14s\n", "counter", "total", "per second");
+    for (uint32_t i = 0; i < COUNTERS; i++) {
+	const uint64_t total = now.total.counters[i];
+	printf("%-24s %16lu %14.0f\n", COUNTER_NAMES[i], (unsigned long) total,
+	       (seconds > 0) ? (total - last.total.counters[i]) / seconds : 0.0);
+    }
+    printf("\n");
+
+    for (uint32_t i = 0; i < GAUGES; i++) {
+	printf("%-24s %16lu\n", GAUGE_NAMES[i], (unsigned long) segment->gauges[i]);
+    }
+    printf("\n");
+
+    if (!segment->timed)
+	return;
+
+    const double hz = cycles_per_second(segment);
+    printf("%-12s %16s %14s %12s %8s\n", "hook", "calls", "per second", "cycles/call", "core %");
+    for (uint32_t i = 0; i < HOOK_CLASSES; i++) {
+	const uint64_t calls = now.total.hook_calls[i] - last.total.hook_calls[i];
+	const uint64_t cycles = now.total.hook_cycles[i] - last.total.hook_cycles[i];
+	printf("%-12s %16lu %14.0f %12.1f %8.1f\n", HOOK_NAMES[i], (unsigned long) now.total.hook_calls[i],
+	       (seconds > 0) ? calls / seconds : 0.0, (calls > 0) ? (double) cycles / calls : 0.0,
+	       ((seconds > 0) && (hz > 0)) ? 100.0 * cycles / (hz * seconds) : 0.0);
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-d seconds] [-n updates] [pid]\n", program);
+    fprintf(stderr, "  -d  seconds between updates (default: 1)\n");
+    fprintf(stderr, "  -n  stop after this many updates (default: until the run ends)\n");
+}
+
+int main(int argc, char **argv) {
+    double delay = 1;
+    long updates = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+	switch (opt) {
+	case 'd': delay = atof(optarg); break;
+	case 'n': updates = atol(optarg); break;
+	default: usage(argv[0]); return 1;
+	}
+    }
+
+    if ((delay <= 0) || (optind + 1 < argc)) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    uint64_t pid;
+    if (optind < argc) {
+	pid = strtoull(argv[optind], NULL, 10);
+    } else {
+	vector<uint64_t> pids;
+	find_runs(pids);
+	if (pids.empty()) {
+	    fprintf(stderr, "No running LAMP profile with live stats\n");
+	    return 1;
+	}
+	if (pids.size() > 1) {
+	    fprintf(stderr, "Several LAMP profiles are running, pick one:");
+	    for (uint32_t i = 0; i < pids.size(); i++) {
+		fprintf(stderr, " %lu", (unsigned long) pids[i]);
+	    }
+	    fprintf(stderr, "\n");
+	    return 1;
+	}
+	pid = pids[0];
+    }
+
+    const stats_segment_t *segment = open_stats_segment(pid);
+    if (segment == NULL) {
+	fprintf(stderr, "No LAMP stats for pid %lu\n", (unsigned long) pid);
+	return 1;
+    }
+
+    const bool clear = isatty(STDOUT_FILENO);
+    sample_t last, now;
+    take_sample(segment, last);
+    last.ns = segment->start_ns;
+    memset(&last.total, 0, sizeof(last.total));
+
+    for (long update = 1; ; update++) {
+	usleep((useconds_t) (delay * 1e6));
+	take_sample(segment, now);
+	const bool running = is_running(pid);
+
+	if (clear) {
+	    printf("\033[H\033[2J");
+	}
+	print_sample(segment, last, now, running);
+	fflush(stdout);
+
+	if (segment->finished || !running || ((updates > 0) && (update >= updates)))
+	    break;
+	if (!clear) {
+	    printf("\n");
+	}
+	last = now;
+    }
+    return 0;
+}
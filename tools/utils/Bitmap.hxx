@@ -0,0 +1,157 @@
+#ifndef BITMAP_HXX
+#define BITMAP_HXX
+
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Memory {
+
+    /**
+     * Kernels over bitmaps kept as arrays of 64-bit words, bit i being bit
+     * (i % 64) of word (i / 64).  Runs of whole words are processed 128
+     * bits at a time with SSE2 where it is available.
+     */
+    static const uint32_t BITMAP_WORD_BITS = 64;
+
+    static inline uint64_t bitmap_word_mask(const uint32_t from, const uint32_t to) {
+	const uint64_t high = (to >= BITMAP_WORD_BITS) ? ~0ULL : ((1ULL << to) - 1);
+	return high & ~((1ULL << from) - 1);
+    }
+
+    static inline void bitmap_fill_words(uint64_t *words, const uint32_t num_words, const uint64_t value) {
+	uint32_t i = 0;
+#ifdef __SSE2__
+	const __m128i fill = _mm_set1_epi64x(value);
+	for (; (i + 2) <= num_words; i += 2) {
+	    _mm_storeu_si128((__m128i *) (words + i), fill);
+	}
+#endif
+	for (; i < num_words; i++) {
+	    words[i] = value;
+	}
+    }
+
+    /**
+     * Sets (value = true) or clears bits [begin, end).
+     */
+    static inline void bitmap_assign_range(uint64_t *words, const uint32_t begin, const uint32_t end, const bool value) {
+	if (begin >= end)
+	    return;
+
+	const uint32_t first = begin / BITMAP_WORD_BITS;
+	const uint32_t last = (end - 1) / BITMAP_WORD_BITS;
+	const uint64_t head = bitmap_word_mask(begin % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+	const uint64_t tail = bitmap_word_mask(0, end - last * BITMAP_WORD_BITS);
+
+	if (first == last) {
+	    const uint64_t mask = head & tail;
+	    words[first] = value ? (words[first] | mask) : (words[first] & ~mask);
+	    return;
+	}
+
+	words[first] = value ? (words[first] | head) : (words[first] & ~head);
+	bitmap_fill_words(words + first + 1, last - first - 1, value ? ~0ULL : 0);
+	words[last] = value ? (words[last] | tail) : (words[last] & ~tail);
+    }
+
+    static inline void bitmap_set_range(uint64_t *words, const uint32_t begin, const uint32_t end) {
+	bitmap_assign_range(words, begin, end, true);
+    }
+
+    static inline void bitmap_clear_range(uint64_t *words, const uint32_t begin, const uint32_t end) {
+	bitmap_assign_range(words, begin, end, false);
+    }
+
+    /**
+     * Invalidation of bits [begin, end) for a pair of valid/invalid maps:
+     * valid bits become unknown (both clear), all others become invalid.
+     */
+    static inline void bitmap_invalidate_range(uint64_t *valid, uint64_t *invalid, const uint32_t begin, const uint32_t end) {
+	if (begin >= end)
+	    return;
+
+	const uint32_t first = begin / BITMAP_WORD_BITS;
+	const uint32_t last = (end - 1) / BITMAP_WORD_BITS;
+	for (uint32_t w = first; w <= last; w++) {
+	    const uint32_t from = (w == first) ? (begin % BITMAP_WORD_BITS) : 0;
+	    const uint32_t to = (w == last) ? (end - last * BITMAP_WORD_BITS) : BITMAP_WORD_BITS;
+	    const uint64_t mask = bitmap_word_mask(from, to);
+
+#ifdef __SSE2__
+	    // whole words in pairs: invalid = ~valid, valid = 0
+	    if ((mask == ~0ULL) && ((w + 2) <= last)) {
+		const __m128i ones = _mm_set1_epi32(-1);
+		for (; (w + 2) <= last; w += 2) {
+		    const __m128i v = _mm_loadu_si128((const __m128i *) (valid + w));
+		    _mm_storeu_si128((__m128i *) (invalid + w), _mm_xor_si128(v, ones));
+		    _mm_storeu_si128((__m128i *) (valid + w), _mm_setzero_si128());
+		}
+		w--;
+		continue;
+	    }
+#endif
+
+	    const uint64_t was_valid = valid[w];
+	    invalid[w] = (invalid[w] & ~mask) | (mask & ~was_valid);
+	    valid[w] = was_valid & ~mask;
+	}
+    }
+
+    static inline uint32_t bitmap_count(const uint64_t *words, const uint32_t num_words) {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < num_words; i++) {
+	    count += __builtin_popcountll(words[i]);
+	}
+	return count;
+    }
+
+    static inline bool bitmap_any(const uint64_t *words, const uint32_t num_words) {
+	uint32_t i = 0;
+#ifdef __SSE2__
+	__m128i any = _mm_setzero_si128();
+	for (; (i + 2) <= num_words; i += 2) {
+	    any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *) (words + i)));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff)
+	    return true;
+#endif
+	for (; i < num_words; i++) {
+	    if (words[i] != 0)
+		return true;
+	}
+	return false;
+    }
+
+    /**
+     * Index of the first set bit at or after from, or -1 if there is none.
+     */
+    static inline int64_t bitmap_find_first(const uint64_t *words, const uint32_t num_words, const uint32_t from) {
+	uint32_t w = from / BITMAP_WORD_BITS;
+	if (w >= num_words)
+	    return -1;
+
+	const uint64_t head = words[w] & bitmap_word_mask(from % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+	if (head != 0)
+	    return ((int64_t) w) * BITMAP_WORD_BITS + __builtin_ctzll(head);
+
+	w++;
+#ifdef __SSE2__
+	for (; (w + 2) <= num_words; w += 2) {
+	    const __m128i pair = _mm_loadu_si128((const __m128i *) (words + w));
+	    if (_mm_movemask_epi8(_mm_cmpeq_epi8(pair, _mm_setzero_si128())) != 0xffff)
+		break;
+	}
+#endif
+	for (; w < num_words; w++) {
+	    if (words[w] != 0)
+		return ((int64_t) w) * BITMAP_WORD_BITS + __builtin_ctzll(words[w]);
+	}
+	return -1;
+    }
+}
+
+#endif
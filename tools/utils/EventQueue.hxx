@@ -0,0 +1,81 @@
+#ifndef EVENT_QUEUE_HXX
+#define EVENT_QUEUE_HXX
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace Collections {
+
+    /**
+     * Fixed size, lock-free ring buffer with exactly one producer thread and
+     * one consumer thread.  Each side keeps a private copy of the other
+     * side's index and only re-reads the shared one when the queue looks
+     * full (producer) or empty (consumer).
+     */
+    template <class T, unsigned int CAPACITY_BITS = 16>
+    class EventQueue {
+    public:
+	static const uint64_t CAPACITY = (1ULL << CAPACITY_BITS);
+
+    private:
+	static const uint64_t MASK = CAPACITY - 1;
+
+	EventQueue(const EventQueue &queue) {}
+
+	EventQueue &operator=(const EventQueue &queue) {return *this;}
+
+	T *events;
+
+	// producer side
+	uint64_t head;
+	uint64_t cached_tail;
+	char pad0[64];
+
+	// consumer side
+	uint64_t tail;
+	uint64_t cached_head;
+	char pad1[64];
+
+    public:
+	EventQueue() : head(0), cached_tail(0), tail(0), cached_head(0) {
+	    this->events = new T[CAPACITY];
+	}
+
+	~EventQueue() {
+	    delete[] this->events;
+	}
+
+	bool push(const T &event) {
+	    const uint64_t h = this->head;
+	    if ((h - this->cached_tail) == CAPACITY) {
+		this->cached_tail = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+		if ((h - this->cached_tail) == CAPACITY)
+		    return false;
+	    }
+
+	    this->events[h & MASK] = event;
+	    __atomic_store_n(&this->head, h + 1, __ATOMIC_RELEASE);
+	    return true;
+	}
+
+	bool pop(T &event) {
+	    const uint64_t t = this->tail;
+	    if (t == this->cached_head) {
+		this->cached_head = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+		if (t == this->cached_head)
+		    return false;
+	    }
+
+	    event = this->events[t & MASK];
+	    __atomic_store_n(&this->tail, t + 1, __ATOMIC_RELEASE);
+	    return true;
+	}
+
+	bool empty() const {
+	    return __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+	}
+    };
+}
+
+#endif
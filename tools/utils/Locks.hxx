@@ -1,5 +1,10 @@
+#ifndef LOCKS_HXX
+#define LOCKS_HXX
+
 #include <pthread.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 namespace Locks {
     class Mutex {
@@ -104,4 +109,33 @@ namespace Locks {
             }
         }
     };
+
+    /**
+     * Busy-waiting lock for very short critical sections, such as a
+     * single shadow page update.
+     */
+    class SpinLock {
+    private:
+        volatile int held;
+
+        SpinLock(const SpinLock &lock) {}
+
+        SpinLock &operator=(const SpinLock &lock) {return *this;}
+
+    public:
+        SpinLock() : held(0) {}
+
+        void lock() {
+            while (__sync_lock_test_and_set(&this->held, 1)) {
+                while (this->held) {
+                }
+            }
+        }
+
+        void unlock() {
+            __sync_lock_release(&this->held);
+        }
+    };
 }
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <iterator>
 #include <cassert>
+#include <string.h>
 #include <vector> //// ajamshid: added 9/4/13
 
 #include "CircularQueue.hxx"
@@ -18,21 +19,38 @@ namespace Loop {
 
     static const uint64_t DEFAULT_DEPENDENCE_DISTANCE = 5;
 
+    // smallest power of two p >= n
+    template <uint64_t n, uint64_t p = 1, bool done = (p >= n)>
+    struct PowerOfTwo {
+	static const uint64_t value = PowerOfTwo<n, 2 * p>::value;
+    };
+
+    template <uint64_t n, uint64_t p>
+    struct PowerOfTwo<n, p, true> {
+	static const uint64_t value = p;
+    };
+
     template<class T, int maxDepDist = DEFAULT_DEPENDENCE_DISTANCE>
     class LoopInfo {
     public:
-	circular_buffer<uint64_t> iteration_time_stamps;
+	static const uint64_t ITERATION_SLOTS = PowerOfTwo<maxDepDist>::value;
+
+	// the last ITERATION_SLOTS iteration stamps, unused slots are 0
+	uint64_t iteration_time_stamps[ITERATION_SLOTS];
+	uint64_t iterations;
 	uint64_t invocation_time_stamp;
-	uint16_t loop_id;
+	uint32_t loop_id;
 	T item;
 
-	LoopInfo() : iteration_time_stamps(maxDepDist), invocation_time_stamp(0), loop_id(0), item() { 
+	LoopInfo() : iterations(0), invocation_time_stamp(0), loop_id(0), item() { 
+	    memset(this->iteration_time_stamps, 0, sizeof(this->iteration_time_stamps));
 	}
 
 	void reset(uint64_t loop, uint64_t time_stamp) {
 	    this->loop_id = loop;
 	    this->invocation_time_stamp = time_stamp;
-	    this->iteration_time_stamps.clear();
+	    this->iterations = 0;
+	    memset(this->iteration_time_stamps, 0, sizeof(this->iteration_time_stamps));
 	}
 
 	T & getItem() {
@@ -44,36 +62,89 @@ namespace Loop {
 	}
 
 	void iteration(uint64_t time_stamp) {
-	    this->iteration_time_stamps.push_back(time_stamp);
+	    this->iteration_time_stamps[this->iterations & (ITERATION_SLOTS - 1)] = time_stamp;
+	    this->iterations++;
+	}
+
+	/**
+	 * Number of iterations begun after store_time_stamp, at most
+	 * maxDepDist.  Iteration stamps only grow, so counting the newer
+	 * slots needs no ordering and no branches.
+	 */
+	uint32_t distance(uint64_t store_time_stamp) const {
+	    uint32_t newer = 0;
+	    for (uint32_t i = 0; i < ITERATION_SLOTS; i++) {
+		newer += (this->iteration_time_stamps[i] > store_time_stamp);
+	    }
+	    return (newer < (uint32_t) maxDepDist) ? newer : (uint32_t) maxDepDist;
+	}
+
+	/**
+	 * Replaces every time stamp of the loop by f(stamp).
+	 */
+	template <class F>
+	void mapTimeStamps(F &f) {
+	    this->invocation_time_stamp = f(this->invocation_time_stamp);
+	    for (uint32_t i = 0; i < ITERATION_SLOTS; i++) {
+		this->iteration_time_stamps[i] = f(this->iteration_time_stamps[i]);
+	    }
 	}
     };
 
-    static const uint64_t DEFAULT_LOOP_DEPTH = 1024;
+    // loop frames are allocated in chunks of this many as the nest deepens
+    static const uint64_t DEFAULT_LOOP_CHUNK = 64;
 
     template <class T,
-	      int maxLoopDepth = DEFAULT_LOOP_DEPTH,
+	      int framesPerChunk = DEFAULT_LOOP_CHUNK,
 	      int maxDepDistance = DEFAULT_DEPENDENCE_DISTANCE>
     class LoopHierarchy {
     public:
 	typedef LoopInfo<T, maxDepDistance> LoopInfoType;
 
-	typedef typename vector<LoopInfoType>::iterator iterator;
-
-	typedef typename vector<LoopInfoType>::reverse_iterator reverse_iterator;
-
 	uint32_t max_depth;
 	
 	uint32_t current_depth;
 
-	vector<LoopInfoType> loop_info;
+	/**
+	 * Frame pool: a frame left by exitLoop is reset and reused by the next
+	 * enterLoop at its depth.  Chunks are never moved or freed before the
+	 * hierarchy, so frame references stay valid.
+	 */
+	vector<LoopInfoType *> chunks;
+
+	// invocation_time_stamp of each allocated frame, kept contiguous for findLoop
+	vector<uint64_t> invocation_time_stamps;
 
-	LoopHierarchy() : max_depth(0), current_depth(-1), loop_info(maxLoopDepth) {
+	LoopHierarchy() : max_depth(0), current_depth(-1), chunks(), invocation_time_stamps() {
 	    enterLoop(0, 0);
 	}
+
+	~LoopHierarchy() {
+	    for (uint32_t i = 0; i < this->chunks.size(); i++) {
+		delete [] this->chunks[i];
+	    }
+	}
+
+    private:
+	LoopHierarchy(const LoopHierarchy &);
+
+	LoopHierarchy & operator=(const LoopHierarchy &);
+
+    public:
+
+	LoopInfoType & frame(const uint32_t depth) {
+	    return this->chunks[depth / framesPerChunk][depth % framesPerChunk];
+	}
 	
 	void enterLoop(uint64_t loop_id, uint64_t timestamp) {
 	    this->current_depth++;
-	    this->loop_info.at(this->current_depth).reset(loop_id, timestamp);
+	    if (this->current_depth == this->invocation_time_stamps.size()) {
+		this->chunks.push_back(new LoopInfoType[framesPerChunk]);
+		this->invocation_time_stamps.resize(this->invocation_time_stamps.size() + framesPerChunk);
+	    }
+
+	    this->frame(this->current_depth).reset(loop_id, timestamp);
+	    this->invocation_time_stamps[this->current_depth] = timestamp;
 
 	    if (this->current_depth > this->max_depth) {
 		this->max_depth = this->current_depth;
@@ -91,45 +162,64 @@ namespace Loop {
 	    this->getCurrentLoop().iteration(time_stamp);
 	}
 
+	/**
+	 * Replaces every time stamp of the active loops by f(stamp); f must
+	 * preserve their order.
+	 */
+	template <class F>
+	void mapTimeStamps(F &f) {
+	    for (uint32_t depth = 0; depth <= this->current_depth; depth++) {
+		this->frame(depth).mapTimeStamps(f);
+		this->invocation_time_stamps[depth] = this->frame(depth).invocation_time_stamp;
+	    }
+	}
+
 	LoopInfoType & getCurrentLoop() {
-		try {                                                    // -PC , 2/5/2009 add catch exception
-	    this->loop_info.at(this->current_depth);
-		}catch (std::out_of_range outOfRange){
-			cout << "\n\nException: " << outOfRange.what();
-			cout << "\nCurrent Loop Depth: " << current_depth;
-		}
-    return this->loop_info.at(this->current_depth);
+	    if (this->current_depth >= this->invocation_time_stamps.size()) {
+		cerr<<"Unbalanced loop exit, current loop depth: "<<(int32_t) this->current_depth<<endl;
+		abort();
+	    }
+	    return this->frame(this->current_depth);
 	}
 
+	/**
+	 * Innermost active loop invoked before store_time_stamp.  A loop is
+	 * invoked at its parent's current time stamp, so invocation stamps
+	 * never decrease with depth and the loops invoked before the store
+	 * are a prefix of the stack.
+	 */
 	LoopInfoType & findLoop(uint64_t store_time_stamp) {
 	    if (store_time_stamp == 0) {
-		return loop_info[0];
+		return this->frame(0);
 	    }
 
-	    for (uint32_t iter = this->current_depth; iter > 0; iter--) {
-		if (loop_info[iter].invocation_time_stamp < store_time_stamp)
-		    return loop_info[iter];
+	    // first depth in [1, current_depth] invoked at or after the store
+	    const uint64_t *stamps = &(this->invocation_time_stamps[0]);
+	    uint32_t low = 1;
+	    uint32_t count = this->current_depth;
+	    while (count > 0) {
+		const uint32_t half = count / 2;
+		if (stamps[low + half] < store_time_stamp) {
+		    low += half + 1;
+		    count -= half + 1;
+		} else {
+		    count = half;
+		}
 	    }
+
+	    if (low > 1)
+		return this->frame(low - 1);
 	    
-	    if (this->loop_info[0].invocation_time_stamp > store_time_stamp) {
-		cerr<<"Unexpected time stamp: "<<this->loop_info[0].invocation_time_stamp<<" > "<<store_time_stamp<<endl;
+	    if (this->frame(0).invocation_time_stamp > store_time_stamp) {
+		cerr<<"Unexpected time stamp: "<<this->frame(0).invocation_time_stamp<<" > "<<store_time_stamp<<endl;
 		abort();
 	    }
 
-	    return this->loop_info[0];
+	    return this->frame(0);
 	}
 
 	uint32_t calculateDistance(LoopInfoType &store_loop, uint64_t store_time_stamp) {
-	    circular_buffer<uint64_t>::reverse_iterator iter = store_loop.iteration_time_stamps.rbegin();
-
-	    uint32_t distance = 0;
-	    for (; iter != store_loop.iteration_time_stamps.rend(); iter++) {
-		if (*iter <= store_time_stamp)
-		    break;
-		distance++;
-	    }
-
-	    return distance;
+	    return store_loop.distance(store_time_stamp);
 	}
     };
 }
@@ -0,0 +1,112 @@
+#include "LoopHierarchy.hxx"
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace Loop;
+
+/**
+ * Microbenchmark of dependence attribution (findLoop + calculateDistance)
+ * at several loop nest depths, against the linear stack scan and the
+ * circular_buffer walk they replaced.
+ *
+ *   make LoopHierarchyBench && ./LoopHierarchyBench
+ */
+
+typedef LoopHierarchy<int> Hierarchy;
+
+typedef Hierarchy::LoopInfoType LoopInfoType;
+
+static const uint32_t QUERIES = 2000000;
+
+static const uint32_t ITERATIONS_PER_LOOP = 3;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * The previous attribution: scan the stack from the innermost loop, then
+ * walk the loop's iteration stamps from the newest.
+ */
+static uint64_t linear_attribute(Hierarchy &hierarchy, vector<circular_buffer<uint64_t> > &rings,
+				 const uint64_t store_time_stamp) {
+    uint32_t depth = 0;
+    for (uint32_t iter = hierarchy.current_depth; iter > 0; iter--) {
+	if (hierarchy.frame(iter).invocation_time_stamp < store_time_stamp) {
+	    depth = iter;
+	    break;
+	}
+    }
+
+    uint32_t distance = 0;
+    circular_buffer<uint64_t>::reverse_iterator iter = rings[depth].rbegin();
+    for (; iter != rings[depth].rend(); iter++) {
+	if (*iter <= store_time_stamp)
+	    break;
+	distance++;
+    }
+
+    return hierarchy.frame(depth).loop_id + distance;
+}
+
+static uint64_t attribute(Hierarchy &hierarchy, const uint64_t store_time_stamp) {
+    LoopInfoType &loop = hierarchy.findLoop(store_time_stamp);
+    return loop.loop_id + hierarchy.calculateDistance(loop, store_time_stamp);
+}
+
+static void bench(const uint32_t depth) {
+    Hierarchy hierarchy;
+    vector<circular_buffer<uint64_t> > rings(depth + 1, circular_buffer<uint64_t>(DEFAULT_DEPENDENCE_DISTANCE));
+
+    // each loop runs a few iterations, then invokes the next one
+    uint64_t time_stamp = 1;
+    for (uint32_t d = 1; d <= depth; d++) {
+	hierarchy.enterLoop(d, time_stamp);
+	for (uint32_t i = 0; i < ITERATIONS_PER_LOOP; i++) {
+	    time_stamp++;
+	    hierarchy.loopIteration(time_stamp);
+	    rings[d].push_back(time_stamp);
+	}
+    }
+
+    vector<uint64_t> stores(QUERIES);
+    uint64_t seed = 12345;
+    for (uint32_t i = 0; i < QUERIES; i++) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	stores[i] = 1 + (seed >> 33) % time_stamp;
+    }
+
+    uint64_t linear_sum = 0, sum = 0;
+    double start = now();
+    for (uint32_t i = 0; i < QUERIES; i++) {
+	linear_sum += linear_attribute(hierarchy, rings, stores[i]);
+    }
+    const double linear = now() - start;
+
+    start = now();
+    for (uint32_t i = 0; i < QUERIES; i++) {
+	sum += attribute(hierarchy, stores[i]);
+    }
+    const double search = now() - start;
+
+    if (sum != linear_sum) {
+	fprintf(stderr, "Attribution differs at depth %u\n", depth);
+	abort();
+    }
+
+    printf("%8u %10.1f ns %10.1f ns %8.1fx\n", depth,
+	   linear * 1e9 / QUERIES, search * 1e9 / QUERIES, linear / search);
+}
+
+extern "C" {
+    int main() {
+	printf("%8s %13s %13s %9s\n", "depth", "linear", "search", "speedup");
+	bench(8);
+	bench(64);
+	bench(1000);
+	return 0;
+    }
+}
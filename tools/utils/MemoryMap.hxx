@@ -9,8 +9,15 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "utils.hxx"
+#include "Bitmap.hxx"
+#include "SlabArena.hxx"
 
+#include <algorithm>
+#include <new>
+#include <vector>
 #include <iostream>
 using namespace std;
 
@@ -122,12 +129,12 @@ namespace Memory {
 	static const uint64_t ADDR_MASK = ~(OFFSET_MASK);
 	
 	// MJB: The code below assumes that no read can be more bytes than bits in a read_track_t
-	typedef uint8_t read_track_t;
+	typedef uint64_t read_track_t;
 
 	static const uint64_t TRACK_BITS_PER_INDEX = (sizeof(read_track_t) * 8);
 
         // This needs to be consistent with TRACK_BITS_PER_INDEX
-        static const uint64_t TRACK_SHIFT_OFFSET = 3;
+	static const uint64_t TRACK_SHIFT_OFFSET = 6;
 
 	static const uint64_t TRACK_SIZE = PAGE_SIZE / TRACK_BITS_PER_INDEX;
 
@@ -174,7 +181,7 @@ namespace Memory {
 	}
 
 	read_track_t mask(const uint8_t length) const {
-	    return ((1ULL << length) - 1);
+	    return (length >= TRACK_BITS_PER_INDEX) ? ~((read_track_t) 0) : ((1ULL << length) - 1);
 	}
 
 	read_track_t offsetMask(const uint8_t length, const uint32_t offset) const {
@@ -259,12 +266,18 @@ namespace Memory {
 	}
 
     public:
+	static const unsigned int PAGE_SHIFT = PAGE_BITS;
+
+	// address of a pooled page; not page aligned, so no address maps to it
+	static const pageaddr_t NO_PAGE_ADDR = 1;
+
         MemoryPage(pageaddr_t addr) : page_addr(addr) {
             if (am_page_addr((void *) addr) != (uint64_t) addr) {
 		cerr<<"Invalid key address"<<endl;
 		abort();
 	    }
 
+	    memset(this->values, 0, sizeof(this->values));
 	    memset(this->valid, 0, sizeof(this->valid));
 	    memset(this->invalid, 0, sizeof(this->invalid));
 	}
@@ -292,7 +305,31 @@ namespace Memory {
 
 	void clear() {
 	    memset(this->valid, 0, sizeof(this->valid));
-            memst(this->invalid, 0, sizeof(this->invalid));
+            memset(this->invalid, 0, sizeof(this->invalid));
+	}
+
+	/**
+	 * Maps a pooled page to addr, with no valid bytes.
+	 */
+	void reset(const pageaddr_t addr) {
+	    this->page_addr = addr;
+	    memset(this->values, 0, sizeof(this->values));
+	    clear();
+	}
+
+	/**
+	 * Unmaps the page for the pool and hands the memory behind its values
+	 * back to the OS.  Pointers to the page stay safe to dereference.
+	 */
+	void release() {
+	    this->page_addr = NO_PAGE_ADDR;
+
+	    const uint64_t os_page = sysconf(_SC_PAGESIZE);
+	    const uint64_t begin = ((uint64_t) (intptr_t) this->values + os_page - 1) & ~(os_page - 1);
+	    const uint64_t end = ((uint64_t) (intptr_t) (this->values + PAGE_SIZE)) & ~(os_page - 1);
+	    if (end > begin) {
+		madvise((void *) begin, end - begin, MADV_DONTNEED);
+	    }
 	}
 
 	const T *getItem(const void * addr) const {
@@ -341,23 +378,182 @@ namespace Memory {
 	void set_invalid(const void *addr, uint8_t length) {
 	    check_range(addr, length);
 	    const uint32_t offset = am_offset(addr);
-
-            for (int i = 0; i < length; i++) {
-                const int coff = offset + i;
-                if (this->is_offset_valid(coff, 1)) {
-                    this->set_offset_unknown(coff, 1);
-                } else {
-                    this->set_offset_invalid(coff, 1);
-                }
-            }
+	    bitmap_invalidate_range(this->valid, this->invalid, offset, offset + length);
 	}
 
 	const valid_t get_aligned_validity(const void * addr, uint8_t length) const {
 	    this->check_range(addr, length);
 	    return this->num_valid(addr, length);
 	}
+
+	/**
+	 * set_valid for [addr, addr + length), which must lie within the
+	 * page.  The bitmaps are updated a track entry at a time.
+	 */
+	void set_range_valid(const void *addr, const uint32_t length) {
+	    check_range(addr, length);
+	    const uint32_t offset = am_offset(addr);
+	    bitmap_set_range(this->valid, offset, offset + length);
+	    bitmap_clear_range(this->invalid, offset, offset + length);
+	}
+
+	/**
+	 * set_invalid for [addr, addr + length): valid bytes become unknown,
+	 * all others invalid.
+	 */
+	void set_range_invalid(const void *addr, const uint32_t length) {
+	    check_range(addr, length);
+	    const uint32_t offset = am_offset(addr);
+	    bitmap_invalidate_range(this->valid, this->invalid, offset, offset + length);
+	}
+
+	uint32_t count_valid() const {
+	    return bitmap_count(this->valid, TRACK_SIZE);
+	}
+
+	bool any_valid() const {
+	    return bitmap_any(this->valid, TRACK_SIZE);
+	}
+
+	bool any_invalid() const {
+	    return bitmap_any(this->invalid, TRACK_SIZE);
+	}
+
+	/**
+	 * Offset of the first valid byte at or after offset, or -1.
+	 */
+	int64_t first_valid(const uint32_t offset) const {
+	    return bitmap_find_first(this->valid, TRACK_SIZE, offset);
+	}
+    };
+
+    /**
+     * Direct-mapped page lookup: a three level radix table indexed by the
+     * page number, so translating an address to its page costs a few shifts
+     * and loads instead of a hash.  Interior tables are allocated on first
+     * use.  Only addresses below 2^ADDRESS_BITS can be mapped.
+     *
+     * A table that only holds every 2^shard_bits-th page, as each shard of
+     * a sharded map does, is indexed by the page number shifted right by
+     * shard_bits, so its tables stay dense.
+     */
+    template<class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
+    class PageTable {
+    private:
+	PageTable(const PageTable &table) {}
+
+	PageTable &operator=(const PageTable &table) {return *this;}
+
+    public:
+	static const uint64_t ADDRESS_BITS = 48;
+
+	static const uint64_t LEAF_BITS = 12;
+
+	static const uint64_t MID_BITS = 12;
+
+	static const uint64_t ROOT_BITS = ADDRESS_BITS - PAGE_BITS - LEAF_BITS - MID_BITS;
+
+    private:
+	static const uint64_t LEAF_MASK = ((1ULL << LEAF_BITS) - 1);
+
+	static const uint64_t MID_MASK = ((1ULL << MID_BITS) - 1);
+
+	typedef T *Leaf[1ULL << LEAF_BITS];
+
+	typedef Leaf *Mid[1ULL << MID_BITS];
+
+	const unsigned int shard_bits;
+
+	const uint64_t root_entries;
+
+	Mid **root;
+
+	uint64_t tables;
+
+	uint64_t index(const pageaddr_t addr) const {
+	    return (addr >> PAGE_BITS) >> this->shard_bits;
+	}
+
+    public:
+	PageTable(const unsigned int shard_bits = 0)
+	    : shard_bits(shard_bits), root_entries(ROUND_UP_DIVISION((1ULL << ROOT_BITS), (1ULL << shard_bits))),
+	      root(NULL), tables(0) {
+	    this->root = (Mid **) calloc(this->root_entries, sizeof(Mid *));
+	    if (this->root == NULL) {
+		fprintf(stderr, "Unable to allocate page table\n");
+		abort();
+	    }
+	}
+
+	~PageTable() {
+	    clear();
+	    free(this->root);
+	}
+
+	static bool mappable(const pageaddr_t addr) {
+	    return (addr >> ADDRESS_BITS) == 0;
+	}
+
+	T *get(const pageaddr_t addr) const {
+	    const uint64_t page = index(addr);
+	    const Mid *mid = this->root[page >> (LEAF_BITS + MID_BITS)];
+	    if (mid == NULL)
+		return NULL;
+
+	    const Leaf *leaf = (*mid)[(page >> LEAF_BITS) & MID_MASK];
+	    if (leaf == NULL)
+		return NULL;
+
+	    return (*leaf)[page & LEAF_MASK];
+	}
+
+	void set(const pageaddr_t addr, T *node) {
+	    const uint64_t page = index(addr);
+	    Mid *&mid = this->root[page >> (LEAF_BITS + MID_BITS)];
+	    if (mid == NULL) {
+		mid = (Mid *) calloc(1, sizeof(Mid));
+		if (mid == NULL) {
+		    fprintf(stderr, "Unable to allocate page table\n");
+		    abort();
+		}
+		this->tables++;
+	    }
+
+	    Leaf *&leaf = (*mid)[(page >> LEAF_BITS) & MID_MASK];
+	    if (leaf == NULL) {
+		leaf = (Leaf *) calloc(1, sizeof(Leaf));
+		if (leaf == NULL) {
+		    fprintf(stderr, "Unable to allocate page table\n");
+		    abort();
+		}
+		this->tables++;
+	    }
+
+	    (*leaf)[page & LEAF_MASK] = node;
+	}
+
+	void clear() {
+	    for (uint64_t i = 0; i < this->root_entries; i++) {
+		Mid *mid = this->root[i];
+		if (mid == NULL)
+		    continue;
+
+		for (uint64_t j = 0; j < (1ULL << MID_BITS); j++) {
+		    free((*mid)[j]);
+		}
+		free(mid);
+		this->root[i] = NULL;
+	    }
+	    this->tables = 0;
+	}
+
+	uint64_t bytes() const {
+	    return sizeof(*this) + this->root_entries * sizeof(Mid *) + this->tables * sizeof(Leaf);
+	}
     };
 
+    enum lookup_t {HASHED = 0, DIRECT = 1};
+
     template<class T>
     class MemoryMap  {
     private:
@@ -369,24 +565,131 @@ namespace Memory {
     protected:
         typedef hash_map<pageaddr_t, T *, PageAddrHash, PageAddrEquals> PageMap;
 
+	typedef PageTable<T, T::PAGE_SHIFT> PageTableType;
+
         PageMap pageMap;
 
+	// Only allocated for DIRECT lookup; pageMap still owns the pages
+	PageTableType *pageTable;
+
+	// released pages, reused before new ones are allocated
+	vector<T *> pagePool;
+
+	uint64_t released;
+
+	uint64_t reused;
+
+	// where pages come from, the general allocator if NULL
+	SlabArena<T> *arena;
+
+	T *newNode(const pageaddr_t paddr) {
+	    if (this->arena == NULL)
+		return new T(paddr);
+	    return new (this->arena->allocate()) T(paddr);
+	}
+
+	void deleteNode(T *node) {
+	    if (this->arena == NULL) {
+		delete node;
+		return;
+	    }
+	    node->~T();
+	    this->arena->deallocate(node);
+	}
+
+	void deletePool() {
+	    for (uint64_t i = 0; i < this->pagePool.size(); i++) {
+		deleteNode(this->pagePool[i]);
+	    }
+	    this->pagePool.clear();
+	}
+
     public:
-	MemoryMap() : pageMap() {}
+	MemoryMap() : pageMap(), pageTable(NULL), pagePool(), released(0), reused(0), arena(NULL) {}
 
         virtual ~MemoryMap() {
             for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
 		T *node = iter->second;
-                delete node;
+                deleteNode(node);
             }
+	    delete this->pageTable;
+	    deletePool();
         }
 
+	/**
+	 * Allocates pages from arena, which must outlive the map.  Only
+	 * allowed before the first page is created.
+	 */
+	void setArena(SlabArena<T> *arena) {
+	    if (!this->pageMap.empty() || !this->pagePool.empty()) {
+		cerr<<"Page arena set after pages were allocated"<<endl;
+		abort();
+	    }
+	    this->arena = arena;
+	}
+
         void clear() {
             for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
 		T *node = iter->second;
-                delete node;
+                deleteNode(node);
             }
 	    pageMap.clear();
+	    if (this->pageTable != NULL)
+		this->pageTable->clear();
+	    deletePool();
+	}
+
+	uint64_t numPages() const {
+	    return this->pageMap.size();
+	}
+
+	uint64_t numReleased() const {
+	    return this->released;
+	}
+
+	uint64_t numReused() const {
+	    return this->reused;
+	}
+
+	/**
+	 * Unmaps node and keeps it for reuse by get_or_create_node.  The page
+	 * object is never freed before the map, so stale pointers to it only
+	 * see a page that maps no address.
+	 */
+	void releaseNode(T *node) {
+	    const pageaddr_t paddr = node->getAddress();
+	    this->pageMap.erase(paddr);
+	    if ((this->pageTable != NULL) && PageTableType::mappable(paddr))
+		this->pageTable->set(paddr, NULL);
+
+	    node->release();
+	    this->pagePool.push_back(node);
+	    this->released++;
+	}
+
+	lookup_t getLookup() const {
+	    return (this->pageTable != NULL) ? DIRECT : HASHED;
+	}
+
+	/**
+	 * With DIRECT lookup, shard_bits is for a map that only holds pages
+	 * whose page number is the same modulo 2^shard_bits, see PageTable.
+	 */
+	void setLookup(const lookup_t lookup, const unsigned int shard_bits = 0) {
+	    if (lookup == getLookup())
+		return;
+
+	    if (lookup == HASHED) {
+		delete this->pageTable;
+		this->pageTable = NULL;
+		return;
+	    }
+
+	    this->pageTable = new PageTableType(shard_bits);
+	    for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
+		if (PageTableType::mappable(iter->first))
+		    this->pageTable->set(iter->first, iter->second);
+	    }
 	}
 
         void clearPages() {
@@ -395,6 +698,16 @@ namespace Memory {
             }
         }
 
+	/**
+	 * Calls f(page) for every page of the map, in no particular order.
+	 */
+	template <class F>
+	void forEachPage(F &f) {
+	    for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
+		f(*(iter->second));
+	    }
+	}
+
 	bool containsPage(const void * addr) {
 	    return (this->find(T::am_page_addr(addr)) != this->pageMap.end());
 	}
@@ -404,6 +717,9 @@ namespace Memory {
 	}
 
 	const T *getNode(const pageaddr_t &addr) const {
+	    if ((this->pageTable != NULL) && PageTableType::mappable(addr))
+		return this->pageTable->get(addr);
+
 	    typename PageMap::const_iterator iter = this->pageMap.find(addr);
 	    if (iter == this->pageMap.end()) return NULL;
 	    return iter->second;
@@ -414,6 +730,9 @@ namespace Memory {
 	}
 
 	T *getNode(const pageaddr_t &addr) {
+	    if ((this->pageTable != NULL) && PageTableType::mappable(addr))
+		return this->pageTable->get(addr);
+
 	    typename PageMap::iterator iter = this->pageMap.find(addr);
 	    if (iter == this->pageMap.end()) return NULL;
 	    return iter->second;
@@ -423,8 +742,17 @@ namespace Memory {
 	    pageaddr_t paddr = T::am_page_addr(addr);
 	    T *item = getNode(paddr);
 	    if (item == NULL) {
-                item = new T(paddr);
+		if (!this->pagePool.empty()) {
+		    item = this->pagePool.back();
+		    this->pagePool.pop_back();
+		    item->reset(paddr);
+		    this->reused++;
+		} else {
+		    item = newNode(paddr);
+		}
                 this->pageMap[paddr] = item;
+		if ((this->pageTable != NULL) && PageTableType::mappable(paddr))
+		    this->pageTable->set(paddr, item);
 	    }
 	    return item;
 	}
@@ -505,6 +833,336 @@ namespace Memory {
 	}
     };
 
+    /**
+     * Page that keeps one value per naturally aligned 8-byte word (or 4-byte
+     * half word) as long as every access to that word is that wide, and only
+     * splits into per-byte values once a narrower access touches it.  The
+     * shared value of a uniform word or half lives in the slot of its first
+     * byte; the remaining slots are stale.  Validity is still tracked per
+     * byte, independent of the uniformity.
+     */
+    template<class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
+    class WordPage : public MemoryPage<T, PAGE_BITS> {
+    private:
+	WordPage(const WordPage &page) : MemoryPage<T, PAGE_BITS>(page) {}
+
+	WordPage &operator=(const WordPage &page) {return *this;}
+
+    protected:
+	static const uint64_t WORD_BYTES = 8;
+
+	static const uint64_t HALF_BYTES = 4;
+
+	static const uint64_t BITMAP_SIZE = ROUND_UP_DIVISION((MemoryPage<T, PAGE_BITS>::PAGE_SIZE / HALF_BYTES), 64);
+
+	uint64_t word_uniform[BITMAP_SIZE];
+
+	uint64_t half_uniform[BITMAP_SIZE];
+
+	static bool test_bit(const uint64_t *bits, const uint32_t index) {
+	    return ((bits[index >> 6] >> (index & 63)) & 1) != 0;
+	}
+
+	static void set_bit(uint64_t *bits, const uint32_t index) {
+	    bits[index >> 6] |= (1ULL << (index & 63));
+	}
+
+	static void clear_bit(uint64_t *bits, const uint32_t index) {
+	    bits[index >> 6] &= ~(1ULL << (index & 63));
+	}
+
+	uint32_t slot(const uint32_t offset) const {
+	    if (test_bit(this->word_uniform, offset / WORD_BYTES))
+		return offset & ~(WORD_BYTES - 1);
+
+	    if (test_bit(this->half_uniform, offset / HALF_BYTES))
+		return offset & ~(HALF_BYTES - 1);
+
+	    return offset;
+	}
+
+	void split_word(const uint32_t offset) {
+	    const uint32_t word = offset / WORD_BYTES;
+	    if (!test_bit(this->word_uniform, word))
+		return;
+
+	    const uint32_t base = offset & ~(WORD_BYTES - 1);
+	    this->values[base + HALF_BYTES] = this->values[base];
+	    clear_bit(this->word_uniform, word);
+	    set_bit(this->half_uniform, base / HALF_BYTES);
+	    set_bit(this->half_uniform, base / HALF_BYTES + 1);
+	}
+
+	void split_half(const uint32_t offset) {
+	    split_word(offset);
+
+	    const uint32_t half = offset / HALF_BYTES;
+	    if (!test_bit(this->half_uniform, half))
+		return;
+
+	    const uint32_t base = offset & ~(HALF_BYTES - 1);
+	    for (uint32_t i = 1; i < HALF_BYTES; i++) {
+		this->values[base + i] = this->values[base];
+	    }
+	    clear_bit(this->half_uniform, half);
+	}
+
+    public:
+	WordPage(pageaddr_t addr) : MemoryPage<T, PAGE_BITS>(addr) {
+	    memset(this->word_uniform, 0, sizeof(this->word_uniform));
+	    memset(this->half_uniform, 0, sizeof(this->half_uniform));
+	}
+
+	void reset(const pageaddr_t addr) {
+	    MemoryPage<T, PAGE_BITS>::reset(addr);
+	    memset(this->word_uniform, 0, sizeof(this->word_uniform));
+	    memset(this->half_uniform, 0, sizeof(this->half_uniform));
+	}
+
+	const T *getItem(const void * addr) const {
+	    this->check_range(addr);
+	    const uint32_t offset = this->am_offset(addr);
+	    if (!this->is_offset_valid(offset, 1))
+		return NULL;
+	    return &(this->values[slot(offset)]);
+	}
+
+	T *getItem(const void * addr) {
+	    this->check_range(addr);
+	    const uint32_t offset = this->am_offset(addr);
+	    if (!this->is_offset_valid(offset, 1))
+		return NULL;
+	    return &(this->values[slot(offset)]);
+	}
+
+	void setItem(const void * addr, const T &item) {
+	    this->check_range(addr);
+	    const uint32_t offset = this->am_offset(addr);
+	    split_half(offset);
+	    this->values[offset] = item;
+	    this->set_offset_valid(offset, 1);
+	}
+
+	/**
+	 * Returns the single value shared by all bytes of the naturally
+	 * aligned S-byte access at addr, or NULL if the bytes are not all
+	 * valid or do not share one uniform slot.
+	 */
+	template <class S>
+	const T *getAlignedItem(const void * addr) const {
+	    this->check_range(addr, sizeof(S));
+	    const uint32_t offset = this->am_offset(addr);
+	    if (!this->is_offset_valid(offset, sizeof(S)))
+		return NULL;
+
+	    if (sizeof(S) == 1)
+		return &(this->values[slot(offset)]);
+
+	    if (test_bit(this->word_uniform, offset / WORD_BYTES))
+		return &(this->values[offset & ~(WORD_BYTES - 1)]);
+
+	    if ((sizeof(S) <= HALF_BYTES) && test_bit(this->half_uniform, offset / HALF_BYTES))
+		return &(this->values[offset & ~(HALF_BYTES - 1)]);
+
+	    return NULL;
+	}
+
+	/**
+	 * Calls f(item) for the values of the valid bytes of the naturally
+	 * aligned S-byte access at addr, in address order, skipping a value
+	 * equal to the previous one: the values getItem gives byte by byte,
+	 * from one read of the valid bits and one visit per uniform slot.
+	 */
+	template <class S, class F>
+	void forEachAlignedItem(const void * addr, F &f) const {
+	    this->check_range(addr, sizeof(S));
+	    const uint32_t offset = this->am_offset(addr);
+	    uint64_t bits = (this->valid[offset >> MemoryPage<T, PAGE_BITS>::TRACK_SHIFT_OFFSET]
+			     >> (offset % MemoryPage<T, PAGE_BITS>::TRACK_BITS_PER_INDEX)) & this->mask(sizeof(S));
+	    if (bits == 0)
+		return;
+
+	    if (test_bit(this->word_uniform, offset / WORD_BYTES)) {
+		f(this->values[offset & ~(WORD_BYTES - 1)]);
+		return;
+	    }
+
+	    const T *last = NULL;
+	    do {
+		const uint32_t i = offset + __builtin_ctzll(bits);
+		uint32_t base = i;
+		if (test_bit(this->half_uniform, i / HALF_BYTES)) {
+		    base = i & ~(HALF_BYTES - 1);
+		    bits &= ~this->mask(base + HALF_BYTES - offset);
+		} else {
+		    bits &= bits - 1;
+		}
+
+		if ((last == NULL) || !(this->values[base] == *last)) {
+		    last = &(this->values[base]);
+		    f(*last);
+		}
+	    } while (bits != 0);
+	}
+
+	/**
+	 * Writes item to every byte of the naturally aligned S-byte access at
+	 * addr.  Word and half-word accesses are a single slot write.
+	 */
+	template <class S>
+	void setAlignedItem(const void * addr, const T &item) {
+	    this->check_range(addr, sizeof(S));
+	    const uint32_t offset = this->am_offset(addr);
+
+	    if (sizeof(S) == WORD_BYTES) {
+		this->values[offset] = item;
+		set_bit(this->word_uniform, offset / WORD_BYTES);
+		clear_bit(this->half_uniform, offset / HALF_BYTES);
+		clear_bit(this->half_uniform, offset / HALF_BYTES + 1);
+	    } else if (sizeof(S) == HALF_BYTES) {
+		split_word(offset);
+		this->values[offset] = item;
+		set_bit(this->half_uniform, offset / HALF_BYTES);
+	    } else {
+		split_half(offset);
+		for (uint32_t i = 0; i < sizeof(S); i++) {
+		    this->values[offset + i] = item;
+		}
+	    }
+
+	    this->set_offset_valid(offset, sizeof(S));
+	}
+
+	/**
+	 * Writes item to every byte of [addr, addr + length), which must lie
+	 * within the page.  Whole words take a single slot write each.
+	 */
+	void setRange(const void * addr, const uint32_t length, const T &item) {
+	    this->check_range(addr, length);
+	    const uint32_t offset = this->am_offset(addr);
+	    const uint32_t end = offset + length;
+
+	    uint32_t i = offset;
+	    for (; (i < end) && ((i % WORD_BYTES) != 0); i++) {
+		split_half(i);
+		this->values[i] = item;
+	    }
+
+	    for (; (i + WORD_BYTES) <= end; i += WORD_BYTES) {
+		this->values[i] = item;
+		set_bit(this->word_uniform, i / WORD_BYTES);
+		clear_bit(this->half_uniform, i / HALF_BYTES);
+		clear_bit(this->half_uniform, i / HALF_BYTES + 1);
+	    }
+
+	    for (; i < end; i++) {
+		split_half(i);
+		this->values[i] = item;
+	    }
+
+	    this->set_range_valid(addr, length);
+	}
+
+	/**
+	 * Calls f(item, count) for each slot backing [addr, addr + length), in
+	 * address order, where count is the number of valid bytes of the
+	 * range that the slot holds.  Slots without valid bytes are skipped.
+	 */
+	template <class F>
+	void forEachItem(const void * addr, const uint32_t length, F &f) const {
+	    this->check_range(addr, length);
+	    const uint32_t offset = this->am_offset(addr);
+	    const uint32_t end = offset + length;
+
+	    for (uint32_t i = offset; i < end; ) {
+		uint32_t base = i;
+		uint32_t next = i + 1;
+		if (test_bit(this->word_uniform, i / WORD_BYTES)) {
+		    base = i & ~(WORD_BYTES - 1);
+		    next = base + WORD_BYTES;
+		} else if (test_bit(this->half_uniform, i / HALF_BYTES)) {
+		    base = i & ~(HALF_BYTES - 1);
+		    next = base + HALF_BYTES;
+		}
+		next = min(next, end);
+
+		// a slot never spans two track entries
+		const uint32_t bit_offset = i % MemoryPage<T, PAGE_BITS>::TRACK_BITS_PER_INDEX;
+		const uint64_t bits = this->valid[i >> MemoryPage<T, PAGE_BITS>::TRACK_SHIFT_OFFSET]
+		    & this->offsetMask(next - i, bit_offset);
+		if (bits != 0) {
+		    f(this->values[base], (uint32_t) __builtin_popcountll(bits));
+		}
+		i = next;
+	    }
+	}
+
+	/**
+	 * Calls f(item) once for each slot of the page that holds a valid
+	 * byte; f may update the item in place.
+	 */
+	template <class F>
+	void updateItems(F &f) {
+	    const uint32_t page_size = MemoryPage<T, PAGE_BITS>::PAGE_SIZE;
+	    for (uint32_t i = 0; i < page_size; ) {
+		uint32_t next = i + 1;
+		if (test_bit(this->word_uniform, i / WORD_BYTES)) {
+		    next = i + WORD_BYTES;
+		} else if (test_bit(this->half_uniform, i / HALF_BYTES)) {
+		    next = i + HALF_BYTES;
+		}
+
+		const uint32_t bit_offset = i % MemoryPage<T, PAGE_BITS>::TRACK_BITS_PER_INDEX;
+		const uint64_t bits = this->valid[i >> MemoryPage<T, PAGE_BITS>::TRACK_SHIFT_OFFSET]
+		    & this->offsetMask(next - i, bit_offset);
+		if (bits != 0) {
+		    f(this->values[i]);
+		}
+		i = next;
+	    }
+	}
+    };
+
+    template <class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
+    class MemoryWordMap : public MemoryMap<WordPage<T, PAGE_BITS> > {
+    public:
+	typedef MemoryWordMap<T, PAGE_BITS> MapType;
+
+	typedef WordPage<T, PAGE_BITS> PageType;
+    private:
+	MemoryWordMap(const MapType &map) {}
+
+	MemoryWordMap &operator=(const MapType &map) {return *this;}
+
+    public:
+	MemoryWordMap() : MemoryMap<PageType>() {}
+
+	virtual ~MemoryWordMap() {}
+
+	const T * getItem(const void *addr) const {
+	    const PageType *node = this->getNode(addr);
+	    if (node == NULL) {
+		return NULL;
+	    }
+
+	    return node->getItem(addr);
+	}
+
+	T * getItem(const void *addr) {
+	    PageType *node = this->getNode(addr);
+	    if (node == NULL) {
+		return NULL;
+	    }
+
+	    return node->getItem(addr);
+	}
+
+	void setItem(const void *addr, const T &item) {
+	    PageType *node = this->get_or_create_node(addr);
+	    node->setItem(addr, item);
+	}
+    };
+
     extern int max_seqno;
 
     /**
@@ -562,61 +1220,71 @@ namespace Memory {
 	void merge(const BytePage *node) {
             uint64_t live_bytes = 0;
 
-	    for (uint64_t i = 0; i < sizeof(this->valid); i++) {
-                const uint64_t offset = i * 8;
-                for (uint64_t granule = offset; granule < offset + MemoryPage<uint8_t, PAGE_BITS>::TRACK_BITS_PER_INDEX ; granule++) {
-                    if (node->is_offset_valid(granule, 1)) {
+	    for (uint64_t i = 0; i < this->TRACK_SIZE; i++) {
+                const uint64_t offset = i * this->TRACK_BITS_PER_INDEX;
+                const uint64_t node_valid = node->valid[i];
+                const uint64_t node_invalid = node->invalid[i] & ~node_valid;
+
+                if (node_valid == ~0ULL) {
+                    memcpy(&this->values[offset], &node->values[offset], this->TRACK_BITS_PER_INDEX);
+                } else {
+                    for (uint64_t bits = node_valid; bits != 0; bits &= (bits - 1)) {
+                        const uint64_t granule = offset + __builtin_ctzll(bits);
 #ifdef MEMMAP_DEBUG
                         fprintf(debug_log, "Writing %lx %lx %p\n", page_addr, granule, (void *) (intptr_t) (page_addr | granule) );
 #endif
                         this->values[granule] = node->values[granule];
-                        this->set_offset_valid(granule, 1);
-                        live_bytes++;
-                    } else if (node->is_offset_invalid(granule, 1)) {
-                        if (this->is_offset_invalid(granule, 1)) {
-                            this->set_offset_unknown(granule, 1);
-                        } else {
-                            this->set_offset_invalid(granule, 1);
-                        }
                     }
                 }
+                live_bytes += __builtin_popcountll(node_valid);
+
+                // valid bytes are taken over; invalid bytes become invalid,
+                // or unknown if they were already invalid here
+                this->valid[i] = (this->valid[i] | node_valid) & ~node_invalid;
+                this->invalid[i] = (this->invalid[i] & ~node_valid) ^ node_invalid;
             }
         }
 
 	void merge_old(const BytePage *node) {
             uint64_t live_bytes = 0;
 
-	    for (uint64_t i = 0; i < sizeof(this->valid); i++) {
-                const uint8_t validity = node->valid[i];
-		this->valid[i] |= validity;
-                const uint64_t offset = i * 8;
-
-                switch(validity) {
-                case 0:   // 0x00
+	    for (uint64_t i = 0; i < this->TRACK_SIZE; i++) {
+                const uint64_t word_validity = node->valid[i];
+		this->valid[i] |= word_validity;
+                if (word_validity == 0)
                     continue;
-                    break;
-                case 15:  // 0x0f
-                    *((uint32_t *) &this->values[offset]) = *((uint32_t *) &node->values[offset]);
-                    break;
-                case 240: // 0xf0
-                    *((uint32_t *) &this->values[offset + 4]) = *((uint32_t *) &node->values[offset + 4]);
-                    break;
-                case 255: // 0xff
-                    *((uint64_t *) &this->values[offset]) = *((uint64_t *) &node->values[offset]);
-                    break;
-                default: 
-                    {
-                        for (uint64_t granule = offset; granule < offset + MemoryPage<uint8_t, PAGE_BITS>::TRACK_BITS_PER_INDEX ; granule++) {
-                            if (node->is_offset_valid(granule, 1)) {
+
+                for (uint64_t j = 0; j < sizeof(word_validity); j++) {
+                    const uint8_t validity = (uint8_t) (word_validity >> (j * 8));
+                    const uint64_t offset = i * this->TRACK_BITS_PER_INDEX + j * 8;
+
+                    switch(validity) {
+                    case 0:   // 0x00
+                        continue;
+                        break;
+                    case 15:  // 0x0f
+                        *((uint32_t *) &this->values[offset]) = *((uint32_t *) &node->values[offset]);
+                        break;
+                    case 240: // 0xf0
+                        *((uint32_t *) &this->values[offset + 4]) = *((uint32_t *) &node->values[offset + 4]);
+                        break;
+                    case 255: // 0xff
+                        *((uint64_t *) &this->values[offset]) = *((uint64_t *) &node->values[offset]);
+                        break;
+                    default: 
+                        {
+                            for (uint64_t granule = offset; granule < offset + 8; granule++) {
+                                if (node->is_offset_valid(granule, 1)) {
 #ifdef MEMMAP_DEBUG
-                                fprintf(debug_log, "Writing %lx %lx %p\n", page_addr, granule, (void *) (intptr_t) (page_addr | granule) );
+                                    fprintf(debug_log, "Writing %lx %lx %p\n", page_addr, granule, (void *) (intptr_t) (page_addr | granule) );
 #endif
-                                this->values[granule] = node->values[granule];
-                                live_bytes++;
+                                    this->values[granule] = node->values[granule];
+                                    live_bytes++;
+                                }
                             }
                         }
+                        break;
                     }
-                    break;
                 }
             }
         }
@@ -627,8 +1295,8 @@ namespace Memory {
 //            uint64_t live_bytes = 0;
 
 	    for (uint64_t i = 0; i < sizeof(this->valid); i++) {
-                uint8_t validity = node->valid[i];
-		this->valid[i] |= validity;
+                uint8_t validity = (uint8_t) (node->valid[i / 8] >> ((i % 8) * 8));
+		this->valid[i / 8] |= ((uint64_t) validity) << ((i % 8) * 8);
                 const uint64_t offset = i * 8;
 
                 if (validity == 0) {
@@ -706,8 +1374,21 @@ namespace Memory {
         bool commit_to_main_memory(FILE *fp) const {
             const uint64_t addr = this->page_addr;
             bool wrote_something = false;
-            for (uint64_t granule = 0; granule < this->PAGE_SIZE; granule++) {
-                if (this->is_offset_valid(granule, 1)) {
+            for (uint64_t i = 0; i < this->TRACK_SIZE; i++) {
+                const uint64_t offset = i * this->TRACK_BITS_PER_INDEX;
+                if (this->valid[i] == 0)
+                    continue;
+
+#if !defined(MEMMAP_DEBUG) && !defined(MEMMAP_DEBUG_BYTE)
+                if (this->valid[i] == ~0ULL) {
+                    memcpy((void *) (intptr_t) (addr | offset), &this->values[offset], this->TRACK_BITS_PER_INDEX);
+                    wrote_something = true;
+                    continue;
+                }
+#endif
+
+                for (uint64_t bits = this->valid[i]; bits != 0; bits &= (bits - 1)) {
+                    const uint64_t granule = offset + __builtin_ctzll(bits);
                     uint8_t *maddr = (uint8_t *) (intptr_t) (addr | granule);
 #ifdef MEMMAP_DEBUG_BYTE
                         {
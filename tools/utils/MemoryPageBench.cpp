@@ -0,0 +1,193 @@
+#include "MemoryMap.hxx"
+
+#include <time.h>
+
+using namespace Memory;
+
+/**
+ * Microbenchmark of the MemoryPage validity bitmaps on whole 4 KB pages,
+ * against the byte-at-a-time tracking they replaced.
+ *
+ *   make MemoryPageBench && ./MemoryPageBench
+ */
+
+static const uint32_t PAGE_SIZE = 4096;
+
+static const uint32_t ROUNDS = 20000;
+
+/**
+ * The previous tracking: one uint8_t per 8 bytes, updated a byte at a time.
+ */
+class ByteTrack {
+public:
+    uint8_t valid[PAGE_SIZE / 8];
+    uint8_t invalid[PAGE_SIZE / 8];
+
+    ByteTrack() {
+	memset(valid, 0, sizeof(valid));
+	memset(invalid, 0, sizeof(invalid));
+    }
+
+    bool is_valid(const uint32_t offset) const {
+	return (valid[offset >> 3] >> (offset & 7)) & 1;
+    }
+
+    void set_valid(const uint32_t offset) {
+	valid[offset >> 3] |= (1 << (offset & 7));
+	invalid[offset >> 3] &= ~(1 << (offset & 7));
+    }
+
+    void set_invalid(const uint32_t offset) {
+	const uint8_t bit = (1 << (offset & 7));
+	if (valid[offset >> 3] & bit) {
+	    valid[offset >> 3] &= ~bit;
+	    invalid[offset >> 3] &= ~bit;
+	} else {
+	    invalid[offset >> 3] |= bit;
+	    valid[offset >> 3] &= ~bit;
+	}
+    }
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, const double bytewise, const double wordwise) {
+    printf("%-16s %10.1f ns %10.1f ns %8.1fx\n", name,
+	   bytewise * 1e9 / ROUNDS, wordwise * 1e9 / ROUNDS, bytewise / wordwise);
+}
+
+static volatile uint64_t sink;
+
+extern "C" {
+    int main() {
+	uint8_t *memory = NULL;
+	if (posix_memalign((void **) &memory, PAGE_SIZE, 2 * PAGE_SIZE) != 0) {
+	    fprintf(stderr, "Unable to allocate pages\n");
+	    abort();
+	}
+	const uint64_t base = (uint64_t) (intptr_t) memory;
+	BytePage<12> *page = new BytePage<12>(base);
+	BytePage<12> *other = new BytePage<12>(base + PAGE_SIZE);
+	ByteTrack *track = new ByteTrack();
+	ByteTrack *other_track = new ByteTrack();
+	double start, bytewise, wordwise;
+
+	printf("%-16s %13s %13s %9s\n", "4 KB page op", "byte-wise", "word-wise", "speedup");
+
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+		track->set_valid(i);
+	    }
+	}
+	bytewise = now() - start;
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    page->set_range_valid(memory, PAGE_SIZE);
+	}
+	wordwise = now() - start;
+	report("set valid", bytewise, wordwise);
+
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+		track->set_invalid(i);
+	    }
+	}
+	bytewise = now() - start;
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    page->set_range_invalid(memory, PAGE_SIZE);
+	}
+	wordwise = now() - start;
+	report("set invalid", bytewise, wordwise);
+
+	// every other 8-byte word valid
+	for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+	    if ((i & 8) == 0) {
+		track->set_valid(i);
+		other_track->set_valid(i);
+	    }
+	}
+	for (uint32_t i = 0; i < PAGE_SIZE; i += 16) {
+	    page->set_range_valid(memory + i, 8);
+	    other->set_range_valid(memory + PAGE_SIZE + i, 8);
+	}
+
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    uint64_t count = 0;
+	    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+		count += track->is_valid(i);
+	    }
+	    sink = count;
+	}
+	bytewise = now() - start;
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    sink = page->count_valid();
+	}
+	wordwise = now() - start;
+	report("count valid", bytewise, wordwise);
+
+	// a single valid byte at the end of the page
+	ByteTrack *sparse_track = new ByteTrack();
+	BytePage<12> *sparse = new BytePage<12>(base);
+	sparse_track->set_valid(PAGE_SIZE - 1);
+	sparse->set_range_valid(memory + PAGE_SIZE - 1, 1);
+
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    uint32_t i = 0;
+	    while ((i < PAGE_SIZE) && !sparse_track->is_valid(i)) {
+		i++;
+	    }
+	    sink = i;
+	}
+	bytewise = now() - start;
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    sink = sparse->first_valid(0);
+	}
+	wordwise = now() - start;
+	report("first valid", bytewise, wordwise);
+
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+		if (other_track->is_valid(i)) {
+		    track->set_valid(i);
+		}
+	    }
+	}
+	bytewise = now() - start;
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    page->merge(other);
+	}
+	wordwise = now() - start;
+	report("merge", bytewise, wordwise);
+
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+		if (track->is_valid(i)) {
+		    memory[i] = (uint8_t) r;
+		}
+	    }
+	}
+	bytewise = now() - start;
+	start = now();
+	for (uint32_t r = 0; r < ROUNDS; r++) {
+	    page->commit_to_main_memory(stdout);
+	}
+	wordwise = now() - start;
+	report("commit", bytewise, wordwise);
+
+	return 0;
+    }
+}
@@ -20,17 +20,60 @@ namespace Profiling {
 	
 	uint64_t loop_count;
 
+	uint64_t epoch;    // iteration loop_count was last incremented in, see incrementLoop
+
+	bool dirty;        // changed since the runtime last logged it in a snapshot
+
     public:
-	MemoryProfile() : total_count(0), loop_count(0) {}
+	MemoryProfile() : total_count(0), loop_count(0), epoch(0), dirty(false) {}
+
+	MemoryProfile(const uint64_t total_count, const uint64_t loop_count)
+	    : total_count(total_count), loop_count(loop_count), epoch(0), dirty(false) {}
 
 	void increment() {
 	    total_count++;
 	}
 
+	void increment(const uint64_t count) {
+	    total_count += count;
+	}
+
 	void incrementLoop() {
 	    loop_count++;
 	}
 
+	/**
+	 * Counts the dependence once per iteration, given a number unique to
+	 * the current iteration of its loop.
+	 */
+	void incrementLoop(const uint64_t iteration_epoch) {
+	    if (epoch != iteration_epoch) {
+		epoch = iteration_epoch;
+		loop_count++;
+	    }
+	}
+
+	bool isDirty() const {
+	    return dirty;
+	}
+
+	void setDirty(const bool dirty) {
+	    this->dirty = dirty;
+	}
+
+	uint64_t getTotalCount() const {
+	    return total_count;
+	}
+
+	uint64_t getLoopCount() const {
+	    return loop_count;
+	}
+
+	void merge(const MemoryProfile &profile) {
+	    total_count += profile.total_count;
+	    loop_count += profile.loop_count;
+	}
+
 	friend ostream &operator<<(ostream &stream, const MemoryProfile &vp);
     };
 
@@ -51,6 +94,12 @@ namespace Profiling {
 	    return profile;
 	}	
 
+	MemoryProfile & increment(const Dependence &dep, const uint64_t count) {
+	    MemoryProfile &profile = this->getProfile(dep);
+	    profile.increment(count);
+	    return profile;
+	}
+
 	template<int S>
 	friend ostream &operator<<(ostream &stream, const MemoryProfiler<S> &vp);
     };
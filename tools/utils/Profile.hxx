@@ -8,13 +8,10 @@
 #include <map>
 #include <vector>
 #include <iterator>
-
-#include <ext/hash_set>
+#include <algorithm>
 
 using namespace std;
 
-using namespace __gnu_cxx;
-
 namespace Profiling {
 
     typedef struct ls_key_s {
@@ -23,11 +20,14 @@ namespace Profiling {
     }  __attribute__((__packed__)) ls_key_t;
 
     bool operator<(const ls_key_t &ls1, const ls_key_t&ls2) {
-        return *((uint32_t *) &ls1) < *((uint32_t *) &ls2);
+	if (ls1.store != ls2.store)
+	    return ls1.store < ls2.store;
+	return ls1.loop < ls2.loop;
     }
 
-    static const uint64_t PROFILE_INSTR_MAX = ((1ULL << 16) - 1);
-    static const uint64_t PROFILE_LOOP_MAX = ((1ULL << 16) - 1);
+    // ids are kept in 32 bits, ~0 marks a missing store or loop
+    static const uint64_t PROFILE_INSTR_MAX = ((1ULL << 32) - 2);
+    static const uint64_t PROFILE_LOOP_MAX = ((1ULL << 32) - 2);
 
     static const uint64_t DEFAULT_TRACKED_DISTANCE = 2;
 
@@ -50,102 +50,206 @@ namespace Profiling {
 	}
     };
     
-    struct DependenceEquals {
-	bool operator()(const Dependence &page1, const Dependence page2) {
-	    return page1 == page2;
-	}
-    };
-
-    struct DependenceHash {
-	size_t operator()(const Dependence &dep) const { 
-	    return dep.store ^ dep.load ^ dep.loop;
-	}
-    };
-
     ostream &operator<<(ostream &stream, const Dependence &dep) {
 	stream<<dep.store<<" "<<dep.loop<<" "<<dep.dist<<" "<<dep.load;
 	return stream;
     }
 
-    typedef hash_set<Dependence, DependenceHash, DependenceEquals> DependenceSet;
-
+    /**
+     * Dependence profile kept in a single open-addressing table keyed by
+     * (load, dist, store, loop).  Updates cost one hash and a short linear
+     * probe; the table is only sorted when it is dumped.
+     */
     template <class T, int maxTrackedDistance = DEFAULT_TRACKED_DISTANCE>
     class KeyDistanceProfiler {
     public:
 
 	static const uint64_t MAX_TRACKED_DISTANCE = maxTrackedDistance;
-		
-	typedef map<ls_key_t, T> KeyProfilerMap;
-	
-	typedef vector<KeyProfilerMap> DistanceMaps;
-	
-	typedef vector<DistanceMaps> InstructionMaps;
-	
+
+	// (load, dist) in the high word and (store, loop) in the low word, so
+	// ordering on the key is the dump order
+	typedef struct profile_key_s {
+	    uint64_t high;
+	    uint64_t low;
+	} profile_key_t;
+
+	typedef struct profile_entry_s {
+	    profile_key_t key;
+	    T profile;
+	} profile_entry_t;
+
+	typedef vector<profile_entry_t> ProfileTable;
+
     private:
-	InstructionMaps instructionInfo;
+	static const uint64_t EMPTY_KEY = ~(0ULL);
+
+	static const uint64_t INITIAL_CAPACITY = 1024;
+
+	ProfileTable table;
+
+	uint64_t mask;
+
+	uint64_t num_entries;
+
+	uint32_t num_instrs;
+
+	static profile_key_t makeKey(const uint32_t load, const uint32_t dist, const uint32_t store, const uint32_t loop) {
+	    const profile_key_t key = {(((uint64_t) load) << 32) | dist, (((uint64_t) store) << 32) | loop};
+	    return key;
+	}
+
+	static uint64_t hashKey(const profile_key_t &key) {
+	    uint64_t h = key.high * 0x9e3779b97f4a7c15ULL;
+	    h ^= key.low + (h >> 29);
+	    h *= 0xbf58476d1ce4e5b9ULL;
+	    return h ^ (h >> 32);
+	}
+
+	static bool lessKey(const profile_entry_t *e1, const profile_entry_t *e2) {
+	    if (e1->key.high != e2->key.high)
+		return e1->key.high < e2->key.high;
+	    return e1->key.low < e2->key.low;
+	}
+
+	void resize(const uint64_t capacity) {
+	    ProfileTable old_table(capacity);
+	    old_table.swap(table);
+	    mask = capacity - 1;
+
+	    for (uint64_t i = 0; i < table.size(); i++) {
+		table[i].key.high = EMPTY_KEY;
+	    }
+
+	    for (uint64_t i = 0; i < old_table.size(); i++) {
+		const profile_entry_t &entry = old_table[i];
+		if (entry.key.high == EMPTY_KEY)
+		    continue;
+
+		uint64_t slot = hashKey(entry.key) & mask;
+		while (table[slot].key.high != EMPTY_KEY) {
+		    slot = (slot + 1) & mask;
+		}
+		table[slot] = entry;
+	    }
+	}
+
+	/**
+	 * Occupied entries in (load, dist, store, loop) order.
+	 */
+	void sortedEntries(vector<const profile_entry_t *> &entries) const {
+	    entries.clear();
+	    entries.reserve(num_entries);
+	    for (uint64_t i = 0; i < table.size(); i++) {
+		if (table[i].key.high != EMPTY_KEY) {
+		    entries.push_back(&table[i]);
+		}
+	    }
+	    sort(entries.begin(), entries.end(), lessKey);
+	}
 
     public:
-	KeyDistanceProfiler(const uint32_t num_instrs) : instructionInfo(num_instrs){
+	KeyDistanceProfiler(const uint32_t num_instrs) : table(), mask(0), num_entries(0), num_instrs(num_instrs) {
             if (sizeof(ls_key_t) != sizeof(uint64_t)) {
                 cerr<<"sizeof(ls_key_t) != sizeof(uint32_t) ("<<sizeof(ls_key_t)<<" != "<<sizeof(uint64_t)<<")"<<endl;
                 abort();
-            }
+	    }
 
 	    if (num_instrs > PROFILE_INSTR_MAX) {
 		cerr<<"Number of instructions must be less than "<<PROFILE_INSTR_MAX<<" "<<num_instrs<<" given"<<endl;
 		abort();
 	    }
+
+	    resize(INITIAL_CAPACITY);
 	}
 
 	static uint32_t trackedDistance(const uint32_t dist) {
 	    const uint32_t tracked_distance = (dist >= maxTrackedDistance) ? (maxTrackedDistance - 1) : dist;
 	    return tracked_distance;
 	}
-	
+
+	/**
+	 * The returned reference is valid until the next call, which may
+	 * grow the table.
+	 */
 	T & getProfile(const Dependence &dep) {
-	    DistanceMaps &distanceMap = instructionInfo.at(dep.load);
-	    
-	    if (distanceMap.empty()) {
-		for (uint32_t i = 0; i < maxTrackedDistance; i++) {
-		    distanceMap.push_back(KeyProfilerMap());
+	    const profile_key_t key = makeKey(dep.load, trackedDistance(dep.dist), dep.store, dep.loop);
+
+	    uint64_t slot = hashKey(key) & mask;
+	    while (true) {
+		profile_entry_t &entry = table[slot];
+		if ((entry.key.high == key.high) && (entry.key.low == key.low))
+		    return entry.profile;
+		if (entry.key.high == EMPTY_KEY)
+		    break;
+		slot = (slot + 1) & mask;
+	    }
+
+	    // keep the load factor at or below 1/2
+	    if (2 * (num_entries + 1) > table.size()) {
+		resize(2 * table.size());
+		slot = hashKey(key) & mask;
+		while (table[slot].key.high != EMPTY_KEY) {
+		    slot = (slot + 1) & mask;
 		}
 	    }
-	    
-	    const uint32_t tracked_distance = trackedDistance(dep.dist);
-
-	    KeyProfilerMap &valueMap = distanceMap.at(tracked_distance);
-	    
-            const ls_key_t key = {dep.store, dep.loop};
-	    if (valueMap.find(key) == valueMap.end()) {
-		T value_count;
-		valueMap[key] = value_count;
+
+	    num_entries++;
+	    table[slot].key = key;
+	    table[slot].profile = T();
+	    return table[slot].profile;
+	}
+
+	uint64_t size() const {
+	    return num_entries;
+	}
+
+	/**
+	 * Calls f(load, dist, loop, store, profile) for every dependence,
+	 * in dump order.
+	 */
+	template <class F>
+	void forEach(F &f) const {
+	    vector<const profile_entry_t *> entries;
+	    sortedEntries(entries);
+	    for (uint64_t i = 0; i < entries.size(); i++) {
+		const profile_key_t &key = entries[i]->key;
+		f((uint32_t) (key.high >> 32), (uint32_t) key.high, (uint32_t) key.low, (uint32_t) (key.low >> 32), entries[i]->profile);
+	    }
+	}
+
+	void merge(const KeyDistanceProfiler<T, maxTrackedDistance> &profiler) {
+	    if (profiler.num_instrs > num_instrs) {
+		num_instrs = profiler.num_instrs;
+	    }
+
+	    for (uint64_t i = 0; i < profiler.table.size(); i++) {
+		const profile_entry_t &entry = profiler.table[i];
+		if (entry.key.high == EMPTY_KEY)
+		    continue;
+
+		const Dependence dep((uint32_t) (entry.key.low >> 32), (uint32_t) entry.key.low,
+				     (uint32_t) entry.key.high, (uint32_t) (entry.key.high >> 32));
+		getProfile(dep).merge(entry.profile);
 	    }
-	    T &profiler = valueMap[key];
-	    return profiler;
 	}
 
 	template<class S, int D>
 	friend ostream &operator<<(ostream &stream, const KeyDistanceProfiler<S, D> &vp);
     };
-    
+
     template<class T, int D>
     ostream &operator<<(ostream &stream, const KeyDistanceProfiler<T, D> &vp){
-	typename KeyDistanceProfiler<T, D>::InstructionMaps::const_iterator instrIter = vp.instructionInfo.begin();
-	for (; instrIter != vp.instructionInfo.end(); instrIter++) {
-	    const uint32_t load = distance(vp.instructionInfo.begin(), instrIter);
-	    typename KeyDistanceProfiler<T, D>::DistanceMaps::const_iterator distIter = instrIter->begin();
-	    for (; distIter != instrIter->end(); distIter++) {
-		const uint32_t dist = distance(instrIter->begin(), distIter);
-		typename KeyDistanceProfiler<T, D>::KeyProfilerMap::const_iterator keyIter = distIter->begin();
-		for(; keyIter != distIter->end(); keyIter++) {
-		    const ls_key_t key = keyIter->first;
-		    const uint32_t loop = key.loop;
-		    const uint32_t store = key.store;
-		    const T &profile = (keyIter->second);
-		    
-		    stream<<"("<<load<<" "<<dist<<" "<<loop<<" "<<store<<" ("<<profile<<") )"<<endl;
-		}
-	    }
+	vector<const typename KeyDistanceProfiler<T, D>::profile_entry_t *> entries;
+	vp.sortedEntries(entries);
+	for (uint64_t i = 0; i < entries.size(); i++) {
+	    const typename KeyDistanceProfiler<T, D>::profile_key_t &key = entries[i]->key;
+	    const uint32_t load = (uint32_t) (key.high >> 32);
+	    const uint32_t dist = (uint32_t) key.high;
+	    const uint32_t store = (uint32_t) (key.low >> 32);
+	    const uint32_t loop = (uint32_t) key.low;
+	    const T &profile = entries[i]->profile;
+
+	    stream<<"("<<load<<" "<<dist<<" "<<loop<<" "<<store<<" ("<<profile<<") )"<<'\n';
 	}
 	return stream;
     }
@@ -0,0 +1,808 @@
+#ifndef PROFILE_FORMAT_H
+#define PROFILE_FORMAT_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "MemoryProfile.hxx"
+
+using namespace std;
+
+namespace Profiling {
+
+    /**
+     * Binary memory profile, written by the LAMP runtime in place of the
+     * text dump and read back through mmap:
+     *
+     *   profile_header_t
+     *   one block per loop that has dependences
+     *   profile_index_t[num_loops], sorted by loop id
+     *
+     * A block holds the loop's dependences sorted by (load, dist, store),
+     * either as raw profile_record_t entries that can be used in place, or,
+     * with PROFILE_COMPRESSED, as LEB128 varints with the load delta-encoded
+     * against the previous record of the block.
+     */
+    static const char PROFILE_MAGIC[8] = {'L', 'A', 'M', 'P', 'P', 'R', 'O', 'F'};
+
+    static const uint32_t PROFILE_VERSION = 1;
+
+    static const uint32_t PROFILE_COMPRESSED = 0x1;
+
+    typedef struct profile_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t num_instrs;
+	uint32_t num_loops;
+	uint64_t num_records;
+	uint64_t index_offset;
+    } profile_header_t;
+
+    typedef struct profile_index_s {
+	uint32_t loop;
+	uint32_t num_records;
+	uint64_t offset;
+	uint64_t length;
+    } profile_index_t;
+
+    typedef struct profile_record_s {
+	uint32_t load;
+	uint32_t store;
+	uint32_t loop;
+	uint32_t dist;
+	uint64_t total_count;
+	uint64_t loop_count;
+    } profile_record_t;
+
+    static inline bool operator<(const profile_record_t &r1, const profile_record_t &r2) {
+	if (r1.load != r2.load)
+	    return r1.load < r2.load;
+	if (r1.dist != r2.dist)
+	    return r1.dist < r2.dist;
+	return r1.store < r2.store;
+    }
+
+    static inline void put_varint(vector<uint8_t> &buffer, uint64_t value) {
+	while (value >= 0x80) {
+	    buffer.push_back((uint8_t) (value | 0x80));
+	    value >>= 7;
+	}
+	buffer.push_back((uint8_t) value);
+    }
+
+    static inline uint64_t get_varint(const uint8_t *&ptr, const uint8_t *end) {
+	uint64_t value = 0;
+	for (uint32_t shift = 0; (ptr < end) && (shift < 64); shift += 7) {
+	    const uint8_t byte = *(ptr++);
+	    value |= ((uint64_t) (byte & 0x7f)) << shift;
+	    if ((byte & 0x80) == 0)
+		break;
+	}
+	return value;
+    }
+
+    class BinaryProfileWriter {
+    private:
+	typedef map<uint32_t, vector<profile_record_t> > LoopRecords;
+
+	LoopRecords loops;
+
+	uint32_t num_instrs;
+
+	bool compressed;
+
+	static void encode(const vector<profile_record_t> &records, vector<uint8_t> &buffer) {
+	    uint32_t last_load = 0;
+	    for (uint32_t i = 0; i < records.size(); i++) {
+		const profile_record_t &record = records[i];
+		put_varint(buffer, record.load - last_load);
+		put_varint(buffer, record.dist);
+		put_varint(buffer, record.store);
+		put_varint(buffer, record.total_count);
+		put_varint(buffer, record.loop_count);
+		last_load = record.load;
+	    }
+	}
+
+    public:
+	BinaryProfileWriter(const uint32_t num_instrs, const bool compressed)
+	    : loops(), num_instrs(num_instrs), compressed(compressed) {}
+
+	void add(const profile_record_t &record) {
+	    loops[record.loop].push_back(record);
+	}
+
+	bool write(const char *filename) {
+	    FILE *fp = fopen(filename, "wb");
+	    if (fp == NULL)
+		return false;
+
+	    profile_header_t header;
+	    memset(&header, 0, sizeof(header));
+	    memcpy(header.magic, PROFILE_MAGIC, sizeof(header.magic));
+	    header.version = PROFILE_VERSION;
+	    header.flags = compressed ? PROFILE_COMPRESSED : 0;
+	    header.num_instrs = num_instrs;
+	    header.num_loops = loops.size();
+
+	    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+	    vector<profile_index_t> index;
+	    vector<uint8_t> buffer;
+	    uint64_t offset = sizeof(header);
+	    for (LoopRecords::iterator iter = loops.begin(); ok && (iter != loops.end()); iter++) {
+		vector<profile_record_t> &records = iter->second;
+		sort(records.begin(), records.end());
+
+		profile_index_t entry;
+		entry.loop = iter->first;
+		entry.num_records = records.size();
+		entry.offset = offset;
+
+		if (compressed) {
+		    buffer.clear();
+		    encode(records, buffer);
+		    entry.length = buffer.size();
+		    ok = (fwrite(&buffer[0], 1, buffer.size(), fp) == buffer.size());
+		} else {
+		    entry.length = records.size() * sizeof(profile_record_t);
+		    ok = (fwrite(&records[0], sizeof(profile_record_t), records.size(), fp) == records.size());
+		}
+
+		offset += entry.length;
+		header.num_records += records.size();
+		index.push_back(entry);
+	    }
+
+	    // keep the index 8-byte aligned for the mmap reader
+	    static const char padding[8] = {0};
+	    const uint64_t pad = (8 - (offset % 8)) % 8;
+	    ok = ok && (fwrite(padding, 1, pad, fp) == pad);
+	    header.index_offset = offset + pad;
+
+	    if (ok && !index.empty()) {
+		ok = (fwrite(&index[0], sizeof(profile_index_t), index.size(), fp) == index.size());
+	    }
+
+	    ok = ok && (fseek(fp, 0, SEEK_SET) == 0);
+	    ok = ok && (fwrite(&header, sizeof(header), 1, fp) == 1);
+	    ok = (fclose(fp) == 0) && ok;
+	    return ok;
+	}
+    };
+
+    /**
+     * Zero-copy reader for the binary profile.  Loops are looked up in the
+     * index, so a client only pays for the loops it asks for.
+     */
+    class BinaryProfileReader {
+    private:
+	BinaryProfileReader(const BinaryProfileReader &reader) {}
+
+	BinaryProfileReader &operator=(const BinaryProfileReader &reader) {return *this;}
+
+	const uint8_t *base;
+
+	size_t length;
+
+	const profile_header_t *header;
+
+	const profile_index_t *index;
+
+    public:
+	BinaryProfileReader() : base(NULL), length(0), header(NULL), index(NULL) {}
+
+	~BinaryProfileReader() {
+	    close();
+	}
+
+	static bool isBinaryProfile(const char *filename) {
+	    char magic[sizeof(PROFILE_MAGIC)];
+	    FILE *fp = fopen(filename, "rb");
+	    if (fp == NULL)
+		return false;
+	    const bool is_binary = (fread(magic, sizeof(magic), 1, fp) == 1)
+		&& (memcmp(magic, PROFILE_MAGIC, sizeof(magic)) == 0);
+	    fclose(fp);
+	    return is_binary;
+	}
+
+	bool open(const char *filename) {
+	    close();
+
+	    const int fd = ::open(filename, O_RDONLY);
+	    if (fd < 0)
+		return false;
+
+	    struct stat st;
+	    if ((fstat(fd, &st) != 0) || ((size_t) st.st_size < sizeof(profile_header_t))) {
+		::close(fd);
+		return false;
+	    }
+
+	    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    ::close(fd);
+	    if (map == MAP_FAILED)
+		return false;
+
+	    this->base = (const uint8_t *) map;
+	    this->length = st.st_size;
+	    this->header = (const profile_header_t *) this->base;
+
+	    if ((memcmp(header->magic, PROFILE_MAGIC, sizeof(PROFILE_MAGIC)) != 0)
+		|| (header->version != PROFILE_VERSION)
+		|| (header->index_offset > this->length)
+		|| (header->num_loops > (this->length - header->index_offset) / sizeof(profile_index_t))) {
+		close();
+		return false;
+	    }
+
+	    this->index = (const profile_index_t *) (this->base + header->index_offset);
+	    for (uint32_t i = 0; i < header->num_loops; i++) {
+		if (!isValidEntry(this->index[i])) {
+		    close();
+		    return false;
+		}
+	    }
+	    return true;
+	}
+
+	/**
+	 * Whether entry's block lies within the file and, uncompressed, holds
+	 * exactly its records.  Truncated or corrupt files fail open().
+	 */
+	bool isValidEntry(const profile_index_t &entry) const {
+	    if ((entry.offset > this->length) || (entry.length > this->length - entry.offset))
+		return false;
+	    return isCompressed() || (entry.num_records * sizeof(profile_record_t) == entry.length);
+	}
+
+	void close() {
+	    if (this->base != NULL) {
+		munmap((void *) this->base, this->length);
+	    }
+	    this->base = NULL;
+	    this->length = 0;
+	    this->header = NULL;
+	    this->index = NULL;
+	}
+
+	bool isCompressed() const {
+	    return (header->flags & PROFILE_COMPRESSED) != 0;
+	}
+
+	uint32_t numInstructions() const {
+	    return header->num_instrs;
+	}
+
+	uint32_t numLoops() const {
+	    return header->num_loops;
+	}
+
+	uint64_t numRecords() const {
+	    return header->num_records;
+	}
+
+	const profile_index_t &getIndex(const uint32_t i) const {
+	    return this->index[i];
+	}
+
+	const profile_index_t *findLoop(const uint32_t loop) const {
+	    uint32_t low = 0;
+	    uint32_t high = header->num_loops;
+	    while (low < high) {
+		const uint32_t mid = low + (high - low) / 2;
+		if (this->index[mid].loop < loop) {
+		    low = mid + 1;
+		} else {
+		    high = mid;
+		}
+	    }
+
+	    if ((low < header->num_loops) && (this->index[low].loop == loop))
+		return &(this->index[low]);
+	    return NULL;
+	}
+
+	/**
+	 * Records of an uncompressed block, used in place.  NULL for
+	 * compressed profiles; use forEachRecord instead.
+	 */
+	const profile_record_t *getRecords(const profile_index_t &entry) const {
+	    if (isCompressed())
+		return NULL;
+	    return (const profile_record_t *) (this->base + entry.offset);
+	}
+
+	template <class F>
+	void forEachRecord(const profile_index_t &entry, F &f) const {
+	    if (!isCompressed()) {
+		const profile_record_t *records = getRecords(entry);
+		for (uint32_t i = 0; i < entry.num_records; i++) {
+		    f(records[i]);
+		}
+		return;
+	    }
+
+	    const uint8_t *ptr = this->base + entry.offset;
+	    const uint8_t *end = ptr + entry.length;
+	    profile_record_t record;
+	    record.load = 0;
+	    record.loop = entry.loop;
+	    for (uint32_t i = 0; (i < entry.num_records) && (ptr < end); i++) {
+		record.load += get_varint(ptr, end);
+		record.dist = get_varint(ptr, end);
+		record.store = get_varint(ptr, end);
+		record.total_count = get_varint(ptr, end);
+		record.loop_count = get_varint(ptr, end);
+		f(record);
+	    }
+	}
+
+	template <class F>
+	bool loadLoop(const uint32_t loop, F &f) const {
+	    const profile_index_t *entry = findLoop(loop);
+	    if (entry == NULL)
+		return false;
+	    forEachRecord(*entry, f);
+	    return true;
+	}
+
+	template <class F>
+	void forEachRecord(F &f) const {
+	    for (uint32_t i = 0; i < header->num_loops; i++) {
+		forEachRecord(this->index[i], f);
+	    }
+	}
+    };
+    /**
+     * Snapshot log, appended to by the LAMP runtime while the program runs
+     * so that a killed or crashed run still leaves a profile behind:
+     *
+     *   snapshot_header_t
+     *   snapshot_frame_t + payload, repeated
+     *
+     * A frame holds the dependences of one source (a profiled thread) whose
+     * counts changed since that source's previous frame, with their new
+     * absolute counts, as varints like a compressed block but with the loop
+     * added.  A frame is only used if it is complete and its checksum
+     * matches, so a reader replays frames up to the first torn one and
+     * recovers the profile of the last snapshot written in full.
+     */
+    static const char SNAPSHOT_MAGIC[8] = {'L', 'A', 'M', 'P', 'S', 'N', 'A', 'P'};
+
+    static const uint32_t SNAPSHOT_VERSION = 1;
+
+    static const uint32_t SNAPSHOT_FRAME_MARKER = 0x4d415246;
+
+    // the source's last frame, written by LAMP_finish
+    static const uint32_t SNAPSHOT_FINAL = 0x1;
+
+    // distances are clamped before they are logged
+    static const int SNAPSHOT_TRACKED_DISTANCE = 0x7fffffff;
+
+    typedef struct snapshot_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_instrs;
+    } snapshot_header_t;
+
+    typedef struct snapshot_frame_s {
+	uint32_t marker;
+	uint32_t source;
+	uint32_t sequence;
+	uint32_t flags;
+	uint64_t num_records;
+	uint64_t length;
+	uint64_t checksum;
+    } snapshot_frame_t;
+
+    /**
+     * FNV-1a over the frame with a zero checksum, then over the payload.
+     */
+    static inline uint64_t snapshot_checksum(const snapshot_frame_t &frame, const uint8_t *payload) {
+	snapshot_frame_t header = frame;
+	header.checksum = 0;
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const uint8_t *bytes = (const uint8_t *) &header;
+	for (uint64_t i = 0; i < sizeof(header); i++) {
+	    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	for (uint64_t i = 0; i < frame.length; i++) {
+	    hash = (hash ^ payload[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+    }
+
+    typedef KeyDistanceProfiler<MemoryProfile, SNAPSHOT_TRACKED_DISTANCE> SnapshotCounts;
+
+    /**
+     * Payload of one frame, built by the source without any shared state:
+     * the absolute counts of the dependences it changed since its previous
+     * frame, in the order they are added.  Loads are delta-encoded modulo
+     * 2^32, so they need not be sorted.
+     */
+    class SnapshotFrame {
+    private:
+	vector<uint8_t> buffer;
+
+	uint64_t num_records;
+
+	uint32_t last_load;
+
+    public:
+	SnapshotFrame() : buffer(), num_records(0), last_load(0) {}
+
+	void clear() {
+	    this->buffer.clear();
+	    this->num_records = 0;
+	    this->last_load = 0;
+	}
+
+	void add(const Dependence &dep, const MemoryProfile &profile) {
+	    put_varint(this->buffer, (uint32_t) (dep.load - this->last_load));
+	    put_varint(this->buffer, dep.dist);
+	    put_varint(this->buffer, dep.store);
+	    put_varint(this->buffer, dep.loop);
+	    put_varint(this->buffer, profile.getTotalCount());
+	    put_varint(this->buffer, profile.getLoopCount());
+	    this->last_load = dep.load;
+	    this->num_records++;
+	}
+
+	uint64_t numRecords() const {
+	    return this->num_records;
+	}
+
+	uint64_t length() const {
+	    return this->buffer.size();
+	}
+
+	const uint8_t *payload() const {
+	    return this->buffer.empty() ? NULL : &(this->buffer[0]);
+	}
+    };
+
+    /**
+     * Appends frames to a snapshot log.  Not thread safe; the runtime
+     * serializes the calls.
+     */
+    class SnapshotWriter {
+    private:
+	SnapshotWriter(const SnapshotWriter &writer) {}
+
+	SnapshotWriter &operator=(const SnapshotWriter &writer) {return *this;}
+
+	int fd;
+
+	uint32_t num_instrs;
+
+	vector<uint32_t> sequences;    // by source
+
+	uint64_t frames;
+
+	uint64_t records;
+
+	uint64_t bytes;
+
+	bool writeFully(const struct iovec *iov, const int count) {
+	    struct iovec parts[2];
+	    copy(iov, iov + count, parts);
+	    int first = 0;
+	    while (first < count) {
+		const ssize_t written = writev(this->fd, parts + first, count - first);
+		if (written < 0)
+		    return false;
+
+		size_t left = written;
+		while ((first < count) && (left >= parts[first].iov_len)) {
+		    left -= parts[first].iov_len;
+		    first++;
+		}
+		if (first < count) {
+		    parts[first].iov_base = (uint8_t *) parts[first].iov_base + left;
+		    parts[first].iov_len -= left;
+		}
+	    }
+	    return true;
+	}
+
+    public:
+	SnapshotWriter() : fd(-1), num_instrs(0), sequences(), frames(0), records(0), bytes(0) {}
+
+	~SnapshotWriter() {
+	    close();
+	}
+
+	bool open(const char *filename, const uint32_t num_instrs) {
+	    close();
+	    this->fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	    if (this->fd < 0)
+		return false;
+
+	    this->num_instrs = num_instrs;
+
+	    snapshot_header_t header;
+	    memset(&header, 0, sizeof(header));
+	    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	    header.version = SNAPSHOT_VERSION;
+	    header.num_instrs = num_instrs;
+
+	    struct iovec iov = {&header, sizeof(header)};
+	    if (!writeFully(&iov, 1)) {
+		close();
+		return false;
+	    }
+	    this->bytes = sizeof(header);
+	    return true;
+	}
+
+	void close() {
+	    if (this->fd >= 0) {
+		::close(this->fd);
+	    }
+	    this->fd = -1;
+	}
+
+	/**
+	 * Logs payload as the source's next frame.  The frame is written with
+	 * a single writev, so a kill can tear at most the frame being written.
+	 */
+	bool write(const uint32_t source, const SnapshotFrame &payload, const bool final) {
+	    if (this->fd < 0)
+		return false;
+
+	    if (source >= this->sequences.size()) {
+		this->sequences.resize(source + 1, 0);
+	    }
+
+	    snapshot_frame_t frame;
+	    frame.marker = SNAPSHOT_FRAME_MARKER;
+	    frame.source = source;
+	    frame.sequence = this->sequences[source]++;
+	    frame.flags = final ? SNAPSHOT_FINAL : 0;
+	    frame.num_records = payload.numRecords();
+	    frame.length = payload.length();
+	    frame.checksum = snapshot_checksum(frame, payload.payload());
+
+	    struct iovec iov[2] = {{&frame, sizeof(frame)}, {(void *) payload.payload(), payload.length()}};
+	    if (!writeFully(iov, 2))
+		return false;
+
+	    this->frames++;
+	    this->records += frame.num_records;
+	    this->bytes += sizeof(frame) + frame.length;
+	    return true;
+	}
+
+	uint64_t numFrames() const {
+	    return this->frames;
+	}
+
+	uint64_t numRecords() const {
+	    return this->records;
+	}
+
+	uint64_t numBytes() const {
+	    return this->bytes;
+	}
+    };
+
+    /**
+     * Replays a snapshot log into the latest counts of every source.  The
+     * profile is the sum over the sources.
+     */
+    class SnapshotReader {
+    private:
+	SnapshotReader(const SnapshotReader &reader) {}
+
+	SnapshotReader &operator=(const SnapshotReader &reader) {return *this;}
+
+	class RecordCollector {
+	private:
+	    vector<profile_record_t> &records;
+
+	public:
+	    RecordCollector(vector<profile_record_t> &records) : records(records) {}
+
+	    void operator()(uint32_t load, uint32_t dist, uint32_t loop, uint32_t store, const MemoryProfile &profile) {
+		profile_record_t record;
+		record.load = load;
+		record.store = store;
+		record.loop = loop;
+		record.dist = dist;
+		record.total_count = profile.getTotalCount();
+		record.loop_count = profile.getLoopCount();
+		records.push_back(record);
+	    }
+	};
+
+	uint32_t num_instrs;
+
+	vector<SnapshotCounts *> sources;
+
+	vector<bool> finished;
+
+	uint64_t frames;
+
+	uint64_t file_length;
+
+	uint64_t valid_length;
+
+	void clear() {
+	    for (uint32_t i = 0; i < this->sources.size(); i++) {
+		delete this->sources[i];
+	    }
+	    this->sources.clear();
+	    this->finished.clear();
+	    this->num_instrs = 0;
+	    this->frames = 0;
+	    this->file_length = 0;
+	    this->valid_length = 0;
+	}
+
+	void apply(const snapshot_frame_t &frame, const uint8_t *ptr) {
+	    if (frame.source >= this->sources.size()) {
+		this->sources.resize(frame.source + 1, NULL);
+		this->finished.resize(frame.source + 1, false);
+	    }
+	    if (this->sources[frame.source] == NULL) {
+		this->sources[frame.source] = new SnapshotCounts(this->num_instrs);
+	    }
+	    SnapshotCounts &counts = *(this->sources[frame.source]);
+
+	    const uint8_t *end = ptr + frame.length;
+	    uint32_t load = 0;
+	    for (uint64_t i = 0; i < frame.num_records; i++) {
+		load += get_varint(ptr, end);
+		const uint32_t dist = get_varint(ptr, end);
+		const uint32_t store = get_varint(ptr, end);
+		const uint32_t loop = get_varint(ptr, end);
+		const uint64_t total_count = get_varint(ptr, end);
+		const uint64_t loop_count = get_varint(ptr, end);
+		counts.getProfile(Dependence(store, loop, dist, load)) = MemoryProfile(total_count, loop_count);
+	    }
+	    this->finished[frame.source] = ((frame.flags & SNAPSHOT_FINAL) != 0);
+	}
+
+    public:
+	SnapshotReader() : num_instrs(0), sources(), finished(), frames(0), file_length(0), valid_length(0) {}
+
+	~SnapshotReader() {
+	    clear();
+	}
+
+	static bool isSnapshotLog(const char *filename) {
+	    char magic[sizeof(SNAPSHOT_MAGIC)];
+	    FILE *fp = fopen(filename, "rb");
+	    if (fp == NULL)
+		return false;
+	    const bool is_log = (fread(magic, sizeof(magic), 1, fp) == 1)
+		&& (memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0);
+	    fclose(fp);
+	    return is_log;
+	}
+
+	/**
+	 * Replays every complete frame.  Fails only if the log header is
+	 * unusable; a torn tail is skipped, see validLength.
+	 */
+	bool open(const char *filename) {
+	    clear();
+
+	    const int fd = ::open(filename, O_RDONLY);
+	    if (fd < 0)
+		return false;
+
+	    struct stat st;
+	    if ((fstat(fd, &st) != 0) || ((size_t) st.st_size < sizeof(snapshot_header_t))) {
+		::close(fd);
+		return false;
+	    }
+
+	    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    ::close(fd);
+	    if (map == MAP_FAILED)
+		return false;
+
+	    const uint8_t *base = (const uint8_t *) map;
+	    const snapshot_header_t *header = (const snapshot_header_t *) base;
+	    if ((memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+		|| (header->version != SNAPSHOT_VERSION)) {
+		munmap(map, st.st_size);
+		return false;
+	    }
+
+	    this->num_instrs = header->num_instrs;
+	    this->file_length = st.st_size;
+
+	    uint64_t offset = sizeof(snapshot_header_t);
+	    while (offset + sizeof(snapshot_frame_t) <= this->file_length) {
+		snapshot_frame_t frame;
+		memcpy(&frame, base + offset, sizeof(frame));
+		const uint8_t *payload = base + offset + sizeof(frame);
+		if ((frame.marker != SNAPSHOT_FRAME_MARKER)
+		    || (frame.length > this->file_length - offset - sizeof(frame))
+		    || (frame.checksum != snapshot_checksum(frame, payload)))
+		    break;
+
+		apply(frame, payload);
+		this->frames++;
+		offset += sizeof(frame) + frame.length;
+	    }
+	    this->valid_length = offset;
+
+	    munmap(map, st.st_size);
+	    return true;
+	}
+
+	uint32_t numInstructions() const {
+	    return this->num_instrs;
+	}
+
+	uint32_t numSources() const {
+	    return this->sources.size();
+	}
+
+	uint64_t numFrames() const {
+	    return this->frames;
+	}
+
+	uint64_t validLength() const {
+	    return this->valid_length;
+	}
+
+	uint64_t fileLength() const {
+	    return this->file_length;
+	}
+
+	/**
+	 * True if every source logged its final frame, i.e. the run ended
+	 * in LAMP_finish.
+	 */
+	bool isComplete() const {
+	    for (uint32_t i = 0; i < this->sources.size(); i++) {
+		if ((this->sources[i] != NULL) && !this->finished[i])
+		    return false;
+	    }
+	    return !this->sources.empty();
+	}
+
+	/**
+	 * Calls f(profile_record_t) for every dependence of the recovered
+	 * profile, summed over the sources, in dump order.
+	 */
+	template <class F>
+	void forEachRecord(F &f) const {
+	    SnapshotCounts total(this->num_instrs);
+	    for (uint32_t i = 0; i < this->sources.size(); i++) {
+		if (this->sources[i] != NULL) {
+		    total.merge(*(this->sources[i]));
+		}
+	    }
+
+	    vector<profile_record_t> records;
+	    records.reserve(total.size());
+	    RecordCollector collector(records);
+	    total.forEach(collector);
+	    for (uint64_t i = 0; i < records.size(); i++) {
+		f(records[i]);
+	    }
+	}
+    };
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef RUNTIME_STATS_HXX
+#define RUNTIME_STATS_HXX
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace Stats {
+
+    /**
+     * Live counters of the LAMP runtime, kept in a file in /dev/shm that
+     * lamp-top maps while the program runs:
+     *
+     *   stats_segment_t, with one cache-line aligned stats_slot_t per thread
+     *
+     * Each profiled thread only updates its own slot, with plain stores, so
+     * a reader sees slightly stale but never torn 64-bit counters.  Threads
+     * beyond STATS_SLOTS share slots and their counts become approximate.
+     * The gauges are refreshed by a publisher thread.
+     */
+    static const char STATS_MAGIC[8] = {'L', 'A', 'M', 'P', 'S', 'T', 'A', 'T'};
+
+    static const uint32_t STATS_VERSION = 2;
+
+    static const uint32_t STATS_SLOTS = 256;
+
+    enum hook_class_t {
+	HOOK_LOAD = 0,
+	HOOK_STORE,
+	HOOK_LOOP,
+	HOOK_MEMORY,
+	HOOK_EXTERNAL,
+	HOOK_CLASSES
+    };
+
+    static const char *const HOOK_NAMES[HOOK_CLASSES] = {"load", "store", "loop", "alloc/free", "external"};
+
+    // updated by whoever analyses the thread's events
+    enum counter_t {
+	PAGE_CACHE_HITS = 0,
+	PAGE_CACHE_MISSES,
+	SHADOW_TLB_HITS,
+	SHADOW_LOOKUPS,
+	DEPENDENCES,
+	UNALIGNED_SPLITS,
+	EXTERNAL_LOAD_BYTES,
+	EXTERNAL_STORE_BYTES,
+	COUNTERS
+    };
+
+    static const char *const COUNTER_NAMES[COUNTERS] = {
+	"page cache hits", "page cache misses", "shadow TLB hits", "shadow lookups", "dependences",
+	"unaligned splits", "external bytes loaded", "external bytes stored"
+    };
+
+    enum gauge_t {
+	SHADOW_PAGES = 0,
+	SHADOW_RECLAIMED,
+	SHADOW_REUSED,
+	ARENA_BYTES,
+	TIME_STAMP,
+	GAUGES
+    };
+
+    static const char *const GAUGE_NAMES[GAUGES] = {
+	"shadow pages", "shadow pages reclaimed", "shadow pages reused", "arena bytes", "time stamp"
+    };
+
+    // three cache lines, so the hook side and the analysis side of a slot
+    // in the segment do not share one
+    typedef struct stats_slot_s {
+	uint64_t hook_calls[8];
+	uint64_t hook_cycles[8];
+	uint64_t counters[8];
+    } stats_slot_t;
+
+    typedef struct stats_segment_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_slots;
+	uint64_t pid;
+	uint32_t num_threads;
+	uint32_t finished;
+	uint32_t timed;       // hook_cycles are measured
+	uint32_t reserved;
+	uint64_t start_ns;
+	uint64_t start_cycles;
+	uint64_t heartbeat_ns;
+	uint64_t heartbeat_cycles;
+	uint64_t gauges[8];
+	stats_slot_t slots[STATS_SLOTS] __attribute__((aligned(64)));
+    } stats_segment_t;
+
+    static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    static inline uint64_t read_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static inline void stats_segment_path(const uint64_t pid, char *path, const size_t length) {
+	snprintf(path, length, "/dev/shm/lamp-stats.%lu", (unsigned long) pid);
+    }
+
+    /**
+     * Creates the segment of process pid; NULL on failure.
+     */
+    static inline stats_segment_t *create_stats_segment(const uint64_t pid) {
+	char path[64];
+	stats_segment_path(pid, path, sizeof(path));
+
+	const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	    return NULL;
+
+	if (ftruncate(fd, sizeof(stats_segment_t)) != 0) {
+	    close(fd);
+	    unlink(path);
+	    return NULL;
+	}
+
+	void *map = mmap(NULL, sizeof(stats_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+	    unlink(path);
+	    return NULL;
+	}
+
+	stats_segment_t *segment = (stats_segment_t *) map;
+	memset(segment, 0, sizeof(stats_segment_t));
+	segment->version = STATS_VERSION;
+	segment->num_slots = STATS_SLOTS;
+	segment->pid = pid;
+	segment->start_ns = read_ns();
+	segment->start_cycles = read_cycles();
+	segment->heartbeat_ns = segment->start_ns;
+	segment->heartbeat_cycles = segment->start_cycles;
+
+	// the magic goes last, a reader ignores a segment without it
+	__sync_synchronize();
+	memcpy(segment->magic, STATS_MAGIC, sizeof(segment->magic));
+	return segment;
+    }
+
+    /**
+     * Maps the segment of process pid read-only; NULL if there is none.
+     */
+    static inline const stats_segment_t *open_stats_segment(const uint64_t pid) {
+	char path[64];
+	stats_segment_path(pid, path, sizeof(path));
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	    return NULL;
+
+	void *map = mmap(NULL, sizeof(stats_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	    return NULL;
+
+	const stats_segment_t *segment = (const stats_segment_t *) map;
+	if ((memcmp(segment->magic, STATS_MAGIC, sizeof(STATS_MAGIC)) != 0) || (segment->version != STATS_VERSION)) {
+	    munmap(map, sizeof(stats_segment_t));
+	    return NULL;
+	}
+	return segment;
+    }
+
+    /**
+     * Per-thread slots summed into one.
+     */
+    static inline void sum_slots(const stats_segment_t *segment, stats_slot_t &total) {
+	memset(&total, 0, sizeof(total));
+	for (uint32_t i = 0; i < segment->num_slots; i++) {
+	    const volatile stats_slot_t &slot = segment->slots[i];
+	    for (uint32_t j = 0; j < 8; j++) {
+		total.hook_calls[j] += slot.hook_calls[j];
+		total.hook_cycles[j] += slot.hook_cycles[j];
+		total.counters[j] += slot.counters[j];
+	    }
+	}
+    }
+}
+
+#endif
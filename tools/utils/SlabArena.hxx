@@ -0,0 +1,205 @@
+#ifndef SLAB_ARENA_HXX
+#define SLAB_ARENA_HXX
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "Locks.hxx"
+
+namespace Memory {
+
+    /**
+     * Fixed-size allocator for the pages of a MemoryMap.  Objects are cut
+     * in address order out of large anonymous mappings (slabs) aligned to
+     * huge page boundaries, so the pages pack densely and the slabs can be
+     * backed by transparent huge pages.  Freed objects are kept on a free
+     * list and handed out before the current slab is extended.  Slabs are
+     * only unmapped with the arena.  Safe to share between threads.
+     */
+    template <class T>
+    class SlabArena {
+    public:
+	static const uint64_t HUGE_PAGE_SIZE = (1ULL << 21);
+
+	static const uint64_t DEFAULT_SLAB_SIZE = (1ULL << 25);
+
+	static const uint64_t OBJECT_ALIGN = 64;
+
+	static const uint64_t OBJECT_SIZE = (sizeof(T) + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1);
+
+    private:
+	SlabArena(const SlabArena &arena) {}
+
+	SlabArena &operator=(const SlabArena &arena) {return *this;}
+
+	const uint64_t slab_size;
+
+	std::vector<char *> slabs;
+
+	char *next;
+
+	char *end;
+
+	std::vector<void *> free_list;
+
+	bool huge_pages;
+
+	uint64_t allocations;
+
+	uint64_t recycled;
+
+	Locks::SpinLock lock;
+
+	void adviseHugePages(char *slab) {
+#ifdef MADV_HUGEPAGE
+	    madvise(slab, this->slab_size, MADV_HUGEPAGE);
+#endif
+	}
+
+	void newSlab() {
+	    // over-allocate by a huge page and trim to an aligned slab
+	    const uint64_t length = this->slab_size + HUGE_PAGE_SIZE;
+	    void *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (mapping == MAP_FAILED) {
+		fprintf(stderr, "Unable to map a %lu byte slab\n", (unsigned long) this->slab_size);
+		abort();
+	    }
+
+	    char *start = (char *) mapping;
+	    char *slab = (char *) (((uint64_t) (intptr_t) start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	    if (slab > start) {
+		munmap(start, slab - start);
+	    }
+	    if ((slab + this->slab_size) < (start + length)) {
+		munmap(slab + this->slab_size, (start + length) - (slab + this->slab_size));
+	    }
+
+	    if (this->huge_pages) {
+		adviseHugePages(slab);
+	    }
+
+	    this->slabs.push_back(slab);
+	    this->next = slab;
+	    this->end = slab + this->slab_size;
+	}
+
+    public:
+	SlabArena(const uint64_t slab_size = DEFAULT_SLAB_SIZE)
+	    : slab_size(slab_size), slabs(), next(NULL), end(NULL), free_list(),
+	      huge_pages(false), allocations(0), recycled(0), lock() {
+	    if ((slab_size < OBJECT_SIZE) || ((slab_size % HUGE_PAGE_SIZE) != 0)) {
+		fprintf(stderr, "Slab size %lu must be a multiple of %lu holding at least one object\n",
+			(unsigned long) slab_size, (unsigned long) HUGE_PAGE_SIZE);
+		abort();
+	    }
+	}
+
+	~SlabArena() {
+	    for (uint64_t i = 0; i < this->slabs.size(); i++) {
+		munmap(this->slabs[i], this->slab_size);
+	    }
+	}
+
+	/**
+	 * Asks for transparent huge pages on every slab, present and future.
+	 */
+	void setHugePages(const bool huge_pages) {
+	    this->lock.lock();
+	    this->huge_pages = huge_pages;
+	    if (huge_pages) {
+		for (uint64_t i = 0; i < this->slabs.size(); i++) {
+		    adviseHugePages(this->slabs[i]);
+		}
+	    }
+	    this->lock.unlock();
+	}
+
+	bool getHugePages() const {
+	    return this->huge_pages;
+	}
+
+	/**
+	 * Uninitialized, OBJECT_ALIGN aligned storage for one T.
+	 */
+	void *allocate() {
+	    this->lock.lock();
+	    void *object;
+	    if (!this->free_list.empty()) {
+		object = this->free_list.back();
+		this->free_list.pop_back();
+		this->recycled++;
+	    } else {
+		if ((this->next == NULL) || ((this->next + OBJECT_SIZE) > this->end)) {
+		    newSlab();
+		}
+		object = this->next;
+		this->next += OBJECT_SIZE;
+	    }
+	    this->allocations++;
+	    this->lock.unlock();
+	    return object;
+	}
+
+	/**
+	 * Returns storage of an already destroyed T to the free list.
+	 */
+	void deallocate(void *object) {
+	    this->lock.lock();
+	    this->free_list.push_back(object);
+	    this->lock.unlock();
+	}
+
+	uint64_t numSlabs() const {
+	    return this->slabs.size();
+	}
+
+	uint64_t mappedBytes() const {
+	    return this->slabs.size() * this->slab_size;
+	}
+
+	uint64_t numAllocations() const {
+	    return this->allocations;
+	}
+
+	uint64_t numRecycled() const {
+	    return this->recycled;
+	}
+
+	/**
+	 * Bytes of the slabs currently backed by transparent huge pages, as
+	 * reported by /proc/self/smaps; 0 where that is not available.
+	 */
+	uint64_t hugePageBytes() const {
+	    FILE *smaps = fopen("/proc/self/smaps", "r");
+	    if (smaps == NULL)
+		return 0;
+
+	    uint64_t bytes = 0;
+	    bool in_slab = false;
+	    char line[256];
+	    while (fgets(line, sizeof(line), smaps) != NULL) {
+		unsigned long start, stop, kb;
+		if (sscanf(line, "%lx-%lx ", &start, &stop) == 2) {
+		    in_slab = false;
+		    for (uint64_t i = 0; i < this->slabs.size(); i++) {
+			const uint64_t slab = (uint64_t) (intptr_t) this->slabs[i];
+			if ((start >= slab) && (start < (slab + this->slab_size))) {
+			    in_slab = true;
+			    break;
+			}
+		    }
+		} else if (in_slab && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)) {
+		    bytes += kb * 1024;
+		}
+	    }
+	    fclose(smaps);
+	    return bytes;
+	}
+    };
+}
+
+#endif
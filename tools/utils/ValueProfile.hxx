@@ -2,6 +2,7 @@
 #define VALUE_PROFILING_H
 
 #include <inttypes.h>
+#include <string.h>
 #include <iostream>
 #include <ostream>
 
@@ -19,79 +20,206 @@ namespace Profiling {
     public:
 	uint64_t value;
 	uint64_t count;
+	uint64_t error;    // count overestimates the value's count by at most this
 
-	ValueCount() : count(0) {}
+	ValueCount() : value(0), count(0), error(0) {}
     };
 
 
+    /**
+     * The values seen by one instruction in one loop.  The top values are
+     * kept in a space-saving sketch, by decreasing count: a new value
+     * replaces the least frequent one and inherits its count as error, so
+     * every value seen more than count / MAX_VALUES times is kept.
+     *
+     * invocations counts the loop invocations the instruction ran in, and
+     * changes how often its value differed from its previous value in the
+     * same invocation; an instruction without changes is loop-invariant.
+     */
     class ValueProfile {
-    private:
-	static const uint64_t MAX_VALUES = 5;
+    public:
+	static const uint32_t MAX_VALUES = 4;
 
+    private:
 	ValueCount values[MAX_VALUES];
 
 	uint64_t count;
 
+	uint64_t invocations;
+
+	uint64_t changes;
+
+	void promote(uint32_t i) {
+	    while ((i > 0) && (values[i - 1].count < values[i].count)) {
+		const ValueCount value = values[i - 1];
+		values[i - 1] = values[i];
+		values[i] = value;
+		i--;
+	    }
+	}
+
     public:
-	ValueProfile() : count(0) {
-            memset(this->values, 0, sizeof(this->values));
-        }
+	ValueProfile() : count(0), invocations(0), changes(0) {}
+
+	void increment(const uint64_t value, const uint64_t weight = 1, const uint64_t error = 0) {
+	    this->count += weight;
 
-	void increment(const uint64_t value) {
-	    this->count++;
-	    
+	    // an unused slot holds value 0, so matching it inserts 0
 	    for (uint32_t i = 0; i < MAX_VALUES; i++) {
 		if (this->values[i].value == value) {
-		    this->values[i].count++;
+		    this->values[i].count += weight;
+		    this->values[i].error += error;
+		    promote(i);
 		    return;
 		}
 	    }
-	    
+
+	    // the last value is unused or the least frequent
+	    ValueCount &last = this->values[MAX_VALUES - 1];
+	    last.value = value;
+	    last.error = last.count + error;
+	    last.count += weight;
+	    promote(MAX_VALUES - 1);
+	}
+
+	void incrementInvocations() {
+	    this->invocations++;
+	}
+
+	void incrementChanges() {
+	    this->changes++;
+	}
+
+	uint64_t getCount() const {
+	    return this->count;
+	}
+
+	uint64_t getInvocations() const {
+	    return this->invocations;
+	}
+
+	uint64_t getChanges() const {
+	    return this->changes;
+	}
+
+	void merge(const ValueProfile &profile) {
 	    for (uint32_t i = 0; i < MAX_VALUES; i++) {
-		if (this->values[i].count == 0) {
-		    this->values[i].value = value;
-		    this->values[i].count = 1;
-		    return;
+		const ValueCount &value = profile.values[i];
+		if (value.count != 0) {
+		    increment(value.value, value.count, value.error);
 		}
 	    }
+	    this->invocations += profile.invocations;
+	    this->changes += profile.changes;
 	}
 
 	friend ostream &operator<<(ostream &stream, const ValueProfile &vp);
     };
 
     ostream &operator<<(ostream &stream, const ValueProfile &vp) {
-	stream<<vp.count<<" : ";
-	if (vp.count == 0)
-	    return stream;
-	    
+	stream<<vp.count<<" "<<vp.invocations<<" "<<vp.changes<<" : ";
 	for (uint32_t j = 0; j < ValueProfile::MAX_VALUES; j++) {
 	    if (vp.values[j].count != 0) {
-		stream<<vp.values[j].value<<" "<<vp.values[j].count<<" : ";
+		stream<<vp.values[j].value<<" "<<vp.values[j].count<<" "<<vp.values[j].error<<" : ";
 	    }
 	}
 
 	return stream;
     }
 
+    /**
+     * Value profiles keyed by (instruction, innermost loop), stored as
+     * dependences without a store.  Updates go to a pending profile of
+     * the instruction, which is only merged into the table when the
+     * instruction runs in another loop, so the common update is a few
+     * compares; flush() before reading or merging the profiler.
+     */
     template <int maxTrackedDistance = DEFAULT_TRACKED_DISTANCE>
     class ValueProfiler : public KeyDistanceProfiler<ValueProfile, maxTrackedDistance> {
+    private:
+	typedef struct pending_s {
+	    uint32_t loop;
+	    uint64_t invocation;
+	    uint64_t last_value;
+	    ValueProfile profile;
+	} pending_t;
+
+	static const uint32_t NO_STORE = ~0U;
+
+	vector<pending_t> pending;
+
+	void flush(const uint32_t instr) {
+	    pending_t &p = pending[instr];
+	    if (p.profile.getCount() == 0)
+		return;
+
+	    this->getProfile(Dependence(NO_STORE, p.loop, 0, instr)).merge(p.profile);
+	    p.profile = ValueProfile();
+	}
+
     public:
-	ValueProfiler(const uint32_t num_instrs) 
-	    : KeyDistanceProfiler<ValueProfile, maxTrackedDistance>(num_instrs) {}
+	ValueProfiler(const uint32_t num_instrs)
+	    : KeyDistanceProfiler<ValueProfile, maxTrackedDistance>(num_instrs), pending(num_instrs) {
+	    for (uint32_t i = 0; i < num_instrs; i++) {
+		pending[i].loop = ~0U;
+		pending[i].invocation = ~0ULL;
+		pending[i].last_value = 0;
+	    }
+	}
+
+	/**
+	 * instr saw value in the given invocation, a number unique to each
+	 * invocation of loop.
+	 */
+	void increment(const uint32_t instr, const uint32_t loop, const uint64_t invocation, const uint64_t value) {
+	    pending_t &p = pending[instr];
+	    if (p.invocation != invocation) {
+		if (p.loop != loop) {
+		    flush(instr);
+		    p.loop = loop;
+		}
+		p.invocation = invocation;
+		p.profile.incrementInvocations();
+	    } else if (p.last_value != value) {
+		p.profile.incrementChanges();
+	    }
+
+	    p.last_value = value;
+	    p.profile.increment(value);
+	}
 
-	void increment(const Dependence &dep, const uint64_t value) {
-	    ValueProfile & valueProfile = this->getProfile(dep);
-	    valueProfile.increment(value);
+	void flush() {
+	    for (uint32_t i = 0; i < pending.size(); i++) {
+		flush(i);
+	    }
 	}
 
 	template<int S>
 	friend ostream &operator<<(ostream &stream, const ValueProfiler<S> &vp);
     };
 
+    class ValueProfileWriter {
+    private:
+	ostream &stream;
+
+    public:
+	ValueProfileWriter(ostream &stream) : stream(stream) {}
+
+	void operator()(const uint32_t instr, const uint32_t dist, const uint32_t loop, const uint32_t store,
+			const ValueProfile &profile) {
+	    stream<<instr<<" "<<loop<<" "<<profile<<'\n';
+	}
+    };
+
+    /**
+     * One line per (instruction, loop):
+     *   instr loop count invocations changes : value count error : ...
+     */
     template<int S>
     ostream &operator<<(ostream &stream, const ValueProfiler<S> &vp) {
 	stream<<"BEGIN Value Profile"<<endl;
-	stream<<((KeyDistanceProfiler<ValueProfile, S> &) vp);
+	ValueProfileWriter writer(stream);
+	vp.forEach(writer);
 	stream<<"END Value Profile"<<endl;
 	return stream;
     }